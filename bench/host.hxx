@@ -0,0 +1,37 @@
+/* File author is Ítalo Lima Marconato Matias
+ *
+ * Created on October 17 of 2026, at 23:59 BRT
+ * Last edited on October 17 of 2026, at 23:59 BRT */
+
+#pragma once
+
+#include <base/types.hxx>
+
+/* The benchmarks are built with the kernel flags (so no host headers), but they run as normal host programs, so we
+ * need to declare the few libc functions that we use. */
+
+extern "C" {
+    int printf(const char*, ...);
+    int putchar(int);
+    int atoi(const char*);
+    void *calloc(unsigned long, unsigned long);
+    void *realloc(void*, unsigned long);
+    void free(void*);
+    void *mmap(void*, unsigned long, int, int, int, long);
+    no_return void abort();
+}
+
+/* Set by Panic::AssertFailed, so that the assertion message isn't thrown away with the rest of the debug output. */
+
+extern CHicago::Boolean BenchVerbose;
+
+/* Recursive mapping windows (vmm.sed replaces the L*_ADDRESS definitions with them), and how many TLB invalidations
+ * were issued (the host can't run invlpg, or touch CR3/CR4). */
+
+extern CHicago::UIntPtr BenchWindows[4], BenchInvlpgs, BenchFlushes;
+
+static inline CHicago::UInt64 BenchTimestamp() {
+    CHicago::UInt32 lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<CHicago::UInt64>(hi) << 32) | lo;
+}
@@ -0,0 +1,108 @@
+/* File author is Ítalo Lima Marconato Matias
+ *
+ * Created on October 17 of 2026, at 23:59 BRT
+ * Last edited on October 17 of 2026, at 23:59 BRT */
+
+/* We need to setup the bitmap by hand (and to turn the buddy allocator off), so let's just open up the PhysMem class
+ * (the layout doesn't change, so this still links against the normal pmm.cxx object). */
+
+#define private public
+#include <sys/mm.hxx>
+#undef private
+
+#include <base/string_view.hxx>
+#include <host.hxx>
+
+using namespace CHicago;
+
+/* 64GiB of physical memory, 90% full: everything is used, except for ~20% of the pages on the higher half (scattered
+ * one by one), which is the worst case for the bitmap scan (as it needs to skip the whole lower half first). */
+
+#define BENCH_MEMORY_SIZE 0x1000000000
+#define BENCH_KERNEL_START 0x100000
+#define BENCH_KERNEL_END 0x200000
+#define BENCH_ALLOCS 2000
+
+/* The benchmark never compacts anything, but ZeroPage still needs MapTemp (for the zero page pool). */
+
+alignas(PAGE_SIZE) static UInt8 TempPage[PAGE_SIZE];
+
+Void *VirtMem::MapTemp(UIntPtr) { return TempPage; }
+Void VirtMem::UnmapTemp() { }
+Status VirtMem::Query(UIntPtr, UIntPtr&, UInt32&) { return Status::NotMapped; }
+Status VirtMem::Map(UIntPtr, UIntPtr, UIntPtr, UInt32) { return Status::InvalidArg; }
+Status VirtMem::Unmap(UIntPtr, UIntPtr, Boolean) { return Status::InvalidArg; }
+
+static UInt32 Seed = 1;
+
+static UInt32 Random() {
+    Seed = Seed * 1103515245 + 12345;
+    return (Seed >> 16) & 0x7FFF;
+}
+
+Int32 main(Int32 Count, Char **Arguments) {
+    /* Usage: pmm_alloc [boot|bitmap|buddy], boot measures the bitmap scan before FinishInitialization (no summaries,
+     * so every region gets checked), bitmap measures it after (but with the buddy allocator disabled), and buddy
+     * measures the normal path. */
+
+    Int32 mode = 1;
+
+    if (Count > 1) {
+        StringView arg(Arguments[1]);
+
+        if (arg.Compare("boot")) mode = 0;
+        else if (arg.Compare("bitmap")) mode = 1;
+        else if (arg.Compare("buddy")) mode = 2;
+        else {
+            printf("usage: %s [boot|bitmap|buddy]\n", Arguments[0]);
+            return 1;
+        }
+    }
+
+    static BootInfoMemMap map[] = { { BENCH_KERNEL_START, (BENCH_MEMORY_SIZE - BENCH_KERNEL_START) >> PAGE_SHIFT,
+                                      BOOT_INFO_MEM_FREE } };
+    static BootInfo info;
+    UIntPtr pages = BENCH_MEMORY_SIZE >> PAGE_SHIFT, first = BENCH_KERNEL_START >> PAGE_SHIFT;
+
+    info.Magic = BOOT_INFO_MAGIC;
+    info.KernelStart = BENCH_KERNEL_START;
+    info.KernelEnd = BENCH_KERNEL_END;
+    info.MaxPhysicalAddress = info.PhysicalMemorySize = BENCH_MEMORY_SIZE;
+    info.MemoryMap.Count = 1;
+    info.MemoryMap.Entries = map;
+    info.RegionsStart = reinterpret_cast<UIntPtr>(calloc(1, ((BENCH_MEMORY_SIZE >> PHYS_REGION_SHIFT) + 1) *
+                                                            sizeof(PhysMem::Region) + pages));
+
+    PhysMem::Initialize(info);
+    PhysMem::InitializeDeferred();
+    PhysMem::MarkPages(first << PAGE_SHIFT, pages - first, True);
+
+    for (UIntPtr i = pages - 1; i > pages / 2; i--) {
+        if (Random() % 100 < 20) PhysMem::MarkPages(i << PAGE_SHIFT, 1, False);
+    }
+
+    if (mode) PhysMem::FinishInitialization();
+    if (mode == 1) PhysMem::Frames = Null;
+
+    static UIntPtr addrs[BENCH_ALLOCS];
+    UInt64 start = BenchTimestamp();
+
+    for (UIntPtr i = 0; i < BENCH_ALLOCS; i++) {
+        if (PhysMem::AllocSingle(addrs[i]) != Status::Success) {
+            printf("AllocSingle failed after %llu allocations\n", i);
+            return 1;
+        }
+    }
+
+    UInt64 middle = BenchTimestamp();
+
+    for (UIntPtr i = 0; i < BENCH_ALLOCS; i++) PhysMem::FreeSingle(addrs[i]);
+
+    UInt64 end = BenchTimestamp();
+
+    printf("%u%% used, AllocSingle: %llu cycles/call, FreeSingle: %llu cycles/call\n",
+           static_cast<UInt32>(PhysMem::GetUsage() * 100 / PhysMem::GetSize()), (middle - start) / BENCH_ALLOCS,
+           (end - middle) / BENCH_ALLOCS);
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+/* File author is Ítalo Lima Marconato Matias
+ *
+ * Created on October 17 of 2026, at 23:59 BRT
+ * Last edited on October 17 of 2026, at 23:59 BRT */
+
+#include <base/string.hxx>
+#include <host.hxx>
+#include <sys/mm.hxx>
+
+using namespace CHicago;
+
+/* Same as what QEMU gives us with a big -m: one huge free range (everything after the first MiB). The region and the
+ * reference lists are touched before we start measuring, so that the page faults of the host don't count. */
+
+#define BENCH_KERNEL_START 0x100000
+#define BENCH_KERNEL_END 0x200000
+
+Void *VirtMem::MapTemp(UIntPtr) { return Null; }
+Void VirtMem::UnmapTemp() { }
+Status VirtMem::Query(UIntPtr, UIntPtr&, UInt32&) { return Status::NotMapped; }
+Status VirtMem::Map(UIntPtr, UIntPtr, UIntPtr, UInt32) { return Status::InvalidArg; }
+Status VirtMem::Unmap(UIntPtr, UIntPtr, Boolean) { return Status::InvalidArg; }
+
+Int32 main(Int32 Count, Char **Arguments) {
+    /* Usage: pmm_init [size in GiB], defaults to 64GiB. */
+
+    UIntPtr size = static_cast<UIntPtr>(Count > 1 ? atoi(Arguments[1]) : 64) << GIANT_PAGE_SHIFT,
+            pages = size >> PAGE_SHIFT, len = ((size >> PHYS_REGION_SHIFT) + 1) * sizeof(PhysMem::Region) + pages;
+
+    if (size <= BENCH_KERNEL_END) {
+        printf("usage: %s [size in GiB]\n", Arguments[0]);
+        return 1;
+    }
+
+    static BootInfoMemMap map[] = { { BENCH_KERNEL_START, 0, BOOT_INFO_MEM_FREE } };
+    static BootInfo info;
+    auto regions = calloc(1, len);
+
+    SetMemory(regions, 0xA5, len);
+
+    map[0].Count = (size - BENCH_KERNEL_START) >> PAGE_SHIFT;
+    info.Magic = BOOT_INFO_MAGIC;
+    info.KernelStart = BENCH_KERNEL_START;
+    info.KernelEnd = BENCH_KERNEL_END;
+    info.MaxPhysicalAddress = info.PhysicalMemorySize = size;
+    info.MemoryMap.Count = 1;
+    info.MemoryMap.Entries = map;
+    info.RegionsStart = reinterpret_cast<UIntPtr>(regions);
+
+    /* Initialize only does enough for the boot, and everything that it skipped is what InitializeDeferred does
+     * (either when the allocator runs out of memory, or when someone calls it), so Initialize + InitializeDeferred
+     * is what the boot path took before it deferred anything. */
+
+    UInt64 start = BenchTimestamp();
+    PhysMem::Initialize(info);
+    UInt64 middle = BenchTimestamp();
+    UIntPtr deferred = PhysMem::GetDeferred();
+    PhysMem::InitializeDeferred();
+    UInt64 end = BenchTimestamp();
+
+    printf("%llu GiB: Initialize took %llu cycles (0x%llx bytes deferred), InitializeDeferred took %llu cycles\n",
+           size / GIANT_PAGE_SIZE, middle - start, deferred, end - middle);
+    printf("boot path: %llu cycles with deferral, %llu cycles without\n", middle - start, end - start);
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+/* File author is Ítalo Lima Marconato Matias
+ *
+ * Created on October 17 of 2026, at 23:59 BRT
+ * Last edited on October 17 of 2026, at 23:59 BRT */
+
+#include <host.hxx>
+#include <sys/arch.hxx>
+#include <sys/mm.hxx>
+#include <sys/panic.hxx>
+#include <vid/console.hxx>
+
+using namespace CHicago;
+
+/* Just enough of the kernel for the memory manager files to link as host programs: the debug console only goes to
+ * stdout (and only when something went wrong), and the kernel heap is the host heap. */
+
+Boolean BenchVerbose = False;
+
+namespace CHicago {
+
+TextConsole Debug;
+
+TextConsole::TextConsole() : Back(), Front(), X(0), BackY(0), FrontY(0), Background(0), Foreground(0),
+                             BackgroundSP(0), ForegroundSP(0), BackgroundStack(), ForegroundStack() { }
+
+Void TextConsole::SetForeground(UInt32) { }
+Void TextConsole::RestoreForeground() { }
+
+Boolean TextConsole::WriteInt(Char Data) {
+    if (BenchVerbose && Data) putchar(Data);
+    return True;
+}
+
+no_return Void Panic::AssertFailed(const StringView &Expression, const StringView &File, const StringView &Function,
+                                   UInt32 Line) {
+    BenchVerbose = True;
+    Debug.Write("assertion '{}' failed at {}:{} ({})\n", Expression, File, Line, Function);
+    abort();
+}
+
+}
+
+UInt64 Arch::GetTimestamp() { return BenchTimestamp(); }
+
+Void *Heap::Allocate(UIntPtr Size) { return calloc(1, Size); }
+Void *Heap::Allocate(UIntPtr Size, UIntPtr) { return calloc(1, Size); }
+Void *Heap::AllocateUninit(UIntPtr Size) { return calloc(1, Size); }
+Void *Heap::AllocateUninit(UIntPtr Size, UIntPtr) { return calloc(1, Size); }
+Void *Heap::Reallocate(Void *Address, UIntPtr Size) { return realloc(Address, Size); }
+Void Heap::Deallocate(Void *Address) { free(Address); }
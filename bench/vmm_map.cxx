@@ -0,0 +1,138 @@
+/* File author is Ítalo Lima Marconato Matias
+ *
+ * Created on October 17 of 2026, at 23:59 BRT
+ * Last edited on October 17 of 2026, at 23:59 BRT */
+
+#include <host.hxx>
+#include <sys/mm.hxx>
+
+using namespace CHicago;
+
+/* Everything goes into the kernel half (outside of the direct map), one 1GiB slot per test. The physical address of
+ * the 4KiB tests is one page off, so that Map can't promote anything to huge pages. */
+
+#define BENCH_BASE 0xFFFF900000000000
+#define BENCH_SPAN 0x100000000
+#define BENCH_PHYS 0x200000000
+
+UIntPtr BenchWindows[4], BenchInvlpgs = 0, BenchFlushes = 0;
+
+/* The page tables themselves are never accessed through their physical address (only through the windows), so any
+ * unique address will do. */
+
+static UIntPtr NextTable = 0x100000000;
+
+Status PhysMem::ReferenceSingle(UIntPtr, UIntPtr &Physical, UIntPtr, UInt32) {
+    Physical = NextTable += PAGE_SIZE;
+    return Status::Success;
+}
+
+Status PhysMem::DereferenceSingle(UIntPtr) { return Status::Success; }
+
+/* VirtMem::Initialize never runs (the windows are setup by main). */
+
+Void Heap::Initialize(UIntPtr, UIntPtr) { }
+
+static UIntPtr AllocWindow(UIntPtr Shift, UIntPtr Mask) {
+    /* Each window only needs to cover the entries for BENCH_SPAN bytes starting at BENCH_BASE, and GetWindow indexes
+     * it using the whole address, so we return a base that points that first entry at the start of the buffer. */
+
+    UIntPtr count = (BENCH_SPAN >> Shift) + 1, buf = reinterpret_cast<UIntPtr>(mmap(Null, count * sizeof(UIntPtr),
+                                                                                      3, 0x22, -1, 0));
+
+    if (buf == UINTPTR_MAX) {
+        printf("couldn't allocate the page table windows\n");
+        abort();
+    }
+
+    return buf - ((BENCH_BASE >> Shift) & Mask) * sizeof(UIntPtr);
+}
+
+struct Test {
+    const Char *Name;
+    UIntPtr Size, Offset, Step;
+    UInt32 Flags, Repeat;
+};
+
+static Boolean Run(const Test &Test, UIntPtr Virtual, Boolean PerPage, UInt64 &MapTime, UInt64 &UnmapTime) {
+    /* Per page means one Map/Unmap call for each page (so that each call walks the directory from the top again),
+     * otherwise we do a single call for the whole range. */
+
+    UIntPtr step = PerPage ? Test.Step : Test.Size;
+    Boolean huge = Test.Flags & MAP_HUGE;
+
+    MapTime = UnmapTime = 0;
+
+    for (UInt32 i = 0; i < Test.Repeat; i++) {
+        UInt64 start = BenchTimestamp();
+
+        for (UIntPtr off = 0; off < Test.Size; off += step) {
+            if (VirtMem::Map(Virtual + off, BENCH_PHYS + Test.Offset + off, step, Test.Flags) != Status::Success) {
+                return False;
+            }
+        }
+
+        UInt64 middle = BenchTimestamp();
+
+        for (UIntPtr off = 0; off < Test.Size; off += step) {
+            if (VirtMem::Unmap(Virtual + off, step, huge) != Status::Success) return False;
+        }
+
+        UInt64 end = BenchTimestamp();
+
+        MapTime += middle - start;
+        UnmapTime += end - middle;
+    }
+
+    MapTime /= Test.Repeat * (Test.Size / Test.Step);
+    UnmapTime /= Test.Repeat * (Test.Size / Test.Step);
+
+    return True;
+}
+
+Int32 main() {
+    static const Test tests[] = {
+        { "4 KiB", PAGE_SIZE, PAGE_SIZE, PAGE_SIZE, MAP_RW | MAP_KERNEL, 100000 },
+        { "2 MiB", HUGE_PAGE_SIZE, PAGE_SIZE, PAGE_SIZE, MAP_RW | MAP_KERNEL, 1000 },
+        { "1 GiB", GIANT_PAGE_SIZE, PAGE_SIZE, PAGE_SIZE, MAP_RW | MAP_KERNEL, 5 },
+        { "1 GiB (2 MiB pages)", GIANT_PAGE_SIZE, 0, HUGE_PAGE_SIZE, MAP_RW | MAP_KERNEL | MAP_HUGE, 1000 }
+    };
+
+    /* The first level window is the whole PML4, the other ones only cover our span (and the level 1 entry is
+     * already there, as the kernel half entries always are). */
+
+    BenchWindows[0] = reinterpret_cast<UIntPtr>(calloc(1 << 9, sizeof(UIntPtr)));
+    BenchWindows[1] = AllocWindow(30, 0x3FFFF);
+    BenchWindows[2] = AllocWindow(21, 0x7FFFFFF);
+    BenchWindows[3] = AllocWindow(12, 0xFFFFFFFFF);
+    reinterpret_cast<UIntPtr*>(BenchWindows[0])[(BENCH_BASE >> 39) & 0x1FF] = NextTable | 3;
+
+    printf("%-20s %22s %22s %8s %8s\n", "span", "map (per page/range)", "unmap (per page/range)", "invlpgs",
+           "flushes");
+
+    for (UIntPtr i = 0; i < sizeof(tests) / sizeof(Test); i++) {
+        UIntPtr virt = BENCH_BASE + i * GIANT_PAGE_SIZE;
+        UInt64 map, unmap, rmap, runmap;
+
+        /* Run everything once before measuring, so that all the tables are already allocated. */
+
+        if (!Run(tests[i], virt, True, map, unmap) || !Run(tests[i], virt, True, map, unmap)) {
+            printf("%s: per page Map/Unmap failed\n", tests[i].Name);
+            return 1;
+        }
+
+        UIntPtr invlpgs = BenchInvlpgs, flushes = BenchFlushes;
+
+        if (!Run(tests[i], virt, False, rmap, runmap)) {
+            printf("%s: range Map/Unmap failed\n", tests[i].Name);
+            return 1;
+        }
+
+        printf("%-20s %10llu/%-11llu %10llu/%-11llu %8llu %8llu\n", tests[i].Name, map, rmap, unmap, runmap,
+               (BenchInvlpgs - invlpgs) / tests[i].Repeat, (BenchFlushes - flushes) / tests[i].Repeat);
+    }
+
+    printf("(cycles per page, invlpgs and flushes are per range call)\n");
+
+    return 0;
+}
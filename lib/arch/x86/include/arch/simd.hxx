@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 18 of 2021, at 13:17 BRT
- * Last edited on March 06 of 2021 at 15:27 BRT */
+ * Last edited on October 17 of 2026 at 12:52 BRT */
 
 disable_ubsan static inline always_inline Floatx2 Round(Floatx2 Vector) { return __builtin_ia32_roundpd(Vector, 0); }
 #ifndef NO_256_SIMD
@@ -15,6 +15,8 @@ disable_ubsan static inline always_inline
 Floatx4 SquareRoot(Floatx4 Vector) { return __builtin_ia32_sqrtpd256(Vector); }
 #endif
 
+disable_ubsan static inline always_inline Void StoreFence() { __builtin_ia32_sfence(); }
+
 disable_ubsan static inline always_inline Void StoreNonTemporal(Void *Buffer, Int64x2 Value) {
     __builtin_ia32_movntdq(reinterpret_cast<Int64x2*>(Buffer), Value);
 }
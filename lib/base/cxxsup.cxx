@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on June 25 of 2020, at 09:22 BRT
- * Last edited on March 05 of 2021, at 14:07 BRT */
+ * Last edited on October 17 of 2026, at 20:15 BRT */
 
 #include <base/std.hxx>
 #include <sys/mm.hxx>
@@ -14,12 +14,13 @@ extern "C" Boolean __cxa_guard_acquire(const UInt64 *Guard) { return !*Guard; }
 extern "C" Void __cxa_guard_release(UInt64 *Guard) { *Guard = True; }
 
 /* Those are the 4 ::new operators that we have to implement: two for normal allocations, and two for aligned
- * allocations. GCC for some reason used long unsigned int for this. */
+ * allocations. GCC for some reason used long unsigned int for this. The constructors (or the caller, for the types
+ * that don't have one) are the ones responsible for initializing the memory, so we don't need to zero it. */
 
-Void *operator new(long unsigned int Size) { return Heap::Allocate(Size); }
-Void *operator new[](long unsigned int Size) { return Heap::Allocate(Size); }
-Void *operator new(long unsigned int Size, align_val_t Align) { return Heap::Allocate(Size, (UIntPtr)Align); }
-Void *operator new[](long unsigned int Size, align_val_t Align) { return Heap::Allocate(Size, (UIntPtr)Align); }
+Void *operator new(long unsigned int Size) { return Heap::AllocateUninit(Size); }
+Void *operator new[](long unsigned int Size) { return Heap::AllocateUninit(Size); }
+Void *operator new(long unsigned int Size, align_val_t Align) { return Heap::AllocateUninit(Size, (UIntPtr)Align); }
+Void *operator new[](long unsigned int Size, align_val_t Align) { return Heap::AllocateUninit(Size, (UIntPtr)Align); }
 
 /* On the ::delete side, we also have 8 operators to implement... */
 
@@ -1,9 +1,10 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on March 05 of 2021, at 10:21 BRT
- * Last edited on April 18 of 2021 at 11:07 BRT */
+ * Last edited on October 17 of 2026 at 21:02 BRT */
 
 #include <base/string.hxx>
+#include <sys/mm.hxx>
 
 using namespace CHicago;
 
@@ -11,7 +12,7 @@ String::String(UIntPtr Length) : String() {
     /* We only need to alloc memory if the length is higher than 16 (as anything less or equal to that we can store in
      * the String class itself). */
 
-    if (Length > 16) if ((Value = new Char[Length + 1]) != Null) Capacity = Length + 1;
+    if (Length > 16) if ((Value = new Char[Length + 1]) != Null) Value[0] = 0, Capacity = Length + 1;
 }
 
 #define CONSTRUCT(l, val, r) \
@@ -149,12 +150,14 @@ Status String::Append(Char Value) {
         Small[Length++] = Value;
         Small[Length] = 0;
     } else if (!Capacity || Length + 1 >= Capacity) {
+        /* Char doesn't have a destructor, and our ::new[] is just Heap::AllocateUninit, so an allocated buffer can be
+         * grown using Heap::Reallocate (which avoids the copy if there is free space right after the buffer). */
+
         UIntPtr nlen = Length < 4 ? 4 : Length * 2 + 1;
-        Char *buf = new Char[nlen];
+        Char *buf = Capacity ? static_cast<Char*>(Heap::Reallocate(this->Value, nlen)) : new Char[nlen];
 
         if (buf == Null) return Status::OutOfMemory;
-        else if (Length) CopyMemory(buf, Capacity ? this->Value : Small, Length);
-        if (Capacity) delete[] this->Value;
+        else if (Length && !Capacity) CopyMemory(buf, Small, Length);
 
         this->Value = buf;
         Capacity = nlen;
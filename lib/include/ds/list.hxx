@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 28 of 2021, at 11:51 BRT
- * Last edited on March 18 of 2021 at 10:31 BRT */
+ * Last edited on October 17 of 2026 at 21:02 BRT */
 
 #pragma once
 
@@ -94,20 +94,18 @@ public:
 
         /* Allocating with new[] would call the destructor for all the items everytime we delete[] it, we don't want
          * that, we want to be able to manually call the destructors using Remove(), and later just deallocate the
-         * memory without calling the destructors again (that is, without causing UB), so let's use the Heap::Allocate
-         * function (which is our malloc function). */
+         * memory without calling the destructors again (that is, without causing UB), so let's use the
+         * Heap::Reallocate function (which is our realloc function, and is going to try growing the buffer in place
+         * before falling back to copying the elements). The first Length items are kept, but the rest needs to be
+         * zeroed (Add assigns into the unused slots). */
 
         if (Size <= Capacity) return Status::InvalidArg;
-        else if ((buf = static_cast<T*>(Heap::Allocate(sizeof(T) * Size))) == Null) return Status::OutOfMemory;
-
-        /* Don't do the same mistake I did when I first wrote this function. Remember to check if this isn't the first
-         * allocation we're doing, if that's the case, we don't need to copy the old elements nor deallocate them. */
-
-        if (Elements != Null) {
-            CopyMemory(buf, Elements, Length * sizeof(T));
-            Heap::Deallocate(Elements);
+        else if ((buf = static_cast<T*>(Heap::Reallocate(Elements, sizeof(T) * Size))) == Null) {
+            return Status::OutOfMemory;
         }
 
+        SetMemory(&buf[Length], 0, (Size - Length) * sizeof(T));
+
         return Elements = buf, Capacity = Size, Status::Success;
     }
 
@@ -123,10 +121,9 @@ public:
         else if (!Length) {
             Heap::Deallocate(Elements);
             return Elements = Null, Capacity = 0, Status::Success;
-        } else if ((buf = static_cast<T*>(Heap::Allocate(sizeof(T) * Length))) == Null) return Status::OutOfMemory;
-
-        CopyMemory(buf, Elements, Length * sizeof(T));
-        Heap::Deallocate(Elements);
+        } else if ((buf = static_cast<T*>(Heap::Reallocate(Elements, sizeof(T) * Length))) == Null) {
+            return Status::OutOfMemory;
+        }
 
         return Elements = buf, Capacity = Length, Status::Success;
     }
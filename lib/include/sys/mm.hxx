@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on March 04 of 2021, at 17:19 BRT
- * Last edited on March 10 of 2021 at 16:55 BRT */
+ * Last edited on October 17 of 2026 at 23:59 BRT */
 
 #pragma once
 
@@ -17,6 +17,8 @@
 #ifdef _LP64
 #define HUGE_PAGE_SHIFT 21
 #define HUGE_PAGE_SIZE 0x200000
+#define GIANT_PAGE_SHIFT 30
+#define GIANT_PAGE_SIZE 0x40000000
 #else
 #define HUGE_PAGE_SHIFT 22
 #define HUGE_PAGE_SIZE 0x400000
@@ -25,6 +27,9 @@
 
 #define PAGE_MASK (PAGE_SIZE - 1)
 #define HUGE_PAGE_MASK (HUGE_PAGE_SIZE - 1)
+#ifdef GIANT_PAGE_SIZE
+#define GIANT_PAGE_MASK (GIANT_PAGE_SIZE - 1)
+#endif
 
 #define PHYS_REGION_SHIFT 22
 #ifdef _LP64
@@ -41,6 +46,28 @@
 #define PHYS_REGION_BSIZE (PAGE_SIZE * PHYS_REGION_PSIZE)
 #define PHYS_REGION_MASK (PHYS_REGION_BSIZE - 1)
 
+#define PHYS_MAX_ORDER 18
+#define PHYS_HUGE_ORDER (HUGE_PAGE_SHIFT - PAGE_SHIFT)
+
+#define PHYS_MAX_CPUS 1
+#define PHYS_MAX_NODES 8
+#define PHYS_MAX_NODE_RANGES 32
+#define PHYS_MAGAZINE_SIZE 64
+#define PHYS_MAGAZINE_BATCH 32
+#define PHYS_ZERO_POOL_SIZE 256
+#define PHYS_MAX_DEFERRED_RANGES 64
+#define PHYS_DEFER_BATCH 16
+#define PHYS_BOOT_FREE_SIZE 0x4000000
+#define PHYS_STAT_BUCKETS 32
+#define PHYS_COMPACT_BUDGET 10000000
+#define PHYS_MAX_SHRINKERS 16
+#define PHYS_WATERMARK_SHIFT 6
+
+#define FRAME_NONE 0xFFFFFFFF
+#define FRAME_FREE 0x01
+#define FRAME_CACHED 0x02
+#define FRAME_MOVABLE 0x04
+
 #define MAP_USER 0x01
 #define MAP_KERNEL 0x02
 #define MAP_READ 0x04
@@ -49,40 +76,165 @@
 #define MAP_HUGE 0x20
 #define MAP_AOR 0x40
 #define MAP_COW 0x80
+#define MAP_GIANT 0x100
 #define MAP_RX (MAP_READ | MAP_EXEC)
 #define MAP_RW (MAP_READ | MAP_WRITE)
 
+#define ALLOC_ZERO 0x01
+
+#define TLB_BATCH_RANGES 8
+#define TLB_FLUSH_CEILING 32
+
 #ifdef _LP64
 #define ALLOC_BLOCK_MAGIC 0xBEEFD337CE8DB73F
+#define ALLOC_SLAB_MAGIC 0x51ABC0DE8DB7F00D
+#define ALLOC_LARGE_MAGIC 0x1A76EB10CC8DB7F0
 #else
 #define ALLOC_BLOCK_MAGIC 0xCE8DB73F
+#define ALLOC_SLAB_MAGIC 0x51ABC0DE
+#define ALLOC_LARGE_MAGIC 0x1A76EB10
 #endif
 
+#define ALLOC_BLOCK_FREE 0x01
+#define ALLOC_BLOCK_TRIMMED 0x02
+#define ALLOC_BLOCK_HEADER (4 * sizeof(UIntPtr))
+
+#define HEAP_SL_SHIFT 4
+#define HEAP_SL_COUNT (1 << HEAP_SL_SHIFT)
+#define HEAP_FL_SHIFT (HEAP_SL_SHIFT + 4)
+#define HEAP_FL_COUNT 32
+#define HEAP_SMALL_SIZE (1 << HEAP_FL_SHIFT)
+
+#define HEAP_SLAB_SHIFT 14
+#define HEAP_SLAB_SIZE (1 << HEAP_SLAB_SHIFT)
+#define HEAP_SLAB_MASK (HEAP_SLAB_SIZE - 1)
+#define HEAP_SLAB_PAGES (HEAP_SLAB_SIZE >> PAGE_SHIFT)
+#define HEAP_SLAB_CLASSES 14
+#define HEAP_SLAB_MAX 2048
+#define HEAP_SLAB_ALIGN 64
+#define HEAP_SLAB_OBJECTS (HEAP_SLAB_SIZE >> 4)
+#define HEAP_SLAB_BITMAP_BITS (sizeof(UIntPtr) * 8)
+#define HEAP_SLAB_START ((sizeof(SlabHeader) + HEAP_SLAB_ALIGN - 1) & -HEAP_SLAB_ALIGN)
+
+#define HEAP_UNMAP_BATCH 64
+
+#define HEAP_LARGE_MIN 0x20000
+#define HEAP_LARGE_SHIFT 2
+#define HEAP_LARGE_RANGES 64
+
+#define HEAP_PROFILE_RATE 0x80000
+#define HEAP_PROFILE_DEPTH 8
+#define HEAP_PROFILE_SKIP 2
+#define HEAP_PROFILE_SITES 128
+#define HEAP_PROFILE_SAMPLES 512
+#define HEAP_PROFILE_BUCKETS 128
+#define HEAP_PROFILE_NONE 0xFFFF
+
 namespace CHicago {
 
 class PhysMem {
 public:
 #ifdef KERNEL
+    /* The summary field has one bit for each bitmap word that isn't full (it used to be the used page count, but that
+     * is always PHYS_REGION_PSIZE - Free, and the loader still expects the region entry to have the same size). */
+
     struct packed Region {
-        UIntPtr Free, Used, Pages[PHYS_REGION_BITMAP_LEN];
+        UIntPtr Free, Summary, Pages[PHYS_REGION_BITMAP_LEN];
+    };
+
+    /* The region bitmap is still the authoritative used/free map, but after FinishInitialization, each physical page
+     * also gets one of those descriptors, which the buddy allocator uses to link the free blocks of each order. The
+     * reference count also lives here (and is only ever touched using atomic operations), the loader provided byte
+     * array is only used before the descriptors exist. The links are only used while the page is free, so we can
+     * reuse the same space to save where movable pages are mapped. */
+
+    struct Frame {
+        union {
+            struct {
+                UInt32 Next, Prev;
+            };
+
+            UIntPtr Mapping;
+        };
+
+        UInt32 References;
+        UInt8 Order, Flags, Node;
+    };
+
+    /* On NUMA machines, each node has its own set of buddy free lists (the blocks never cross into another node), so
+     * that we can prefer allocating from the local node. The size is how much of the physical address space is
+     * covered by the node (and the free count only includes what is on the free lists). */
+
+    struct Zone {
+        UInt32 FreeLists[PHYS_MAX_ORDER + 1];
+        UIntPtr FreeMask, First, Size, Free, Fallbacks;
+    };
+
+    struct NodeRange {
+        UIntPtr Start, End;
+        UInt8 Node;
+    };
+
+    /* Free ranges from the boot memory map, saved so that the regions that we didn't initialize during the boot can
+     * be initialized later. */
+
+    struct DeferredRange {
+        UIntPtr Start, End;
+    };
+
+    /* Each CPU has a small stack of free pages, so that most single page allocations/deallocations don't need to
+     * touch the global bitmap (or the buddy free lists). The pages on it are still marked as used on the bitmap. */
+
+    struct Magazine {
+        UIntPtr Count, Pages[PHYS_MAGAZINE_SIZE];
+    };
+
+    /* Snapshot of the instrumentation counters (see GetStatistics). All the histograms use power of two buckets (the
+     * bucket n counts the values in the [2^n, 2^(n+1)) range, with bucket 0 also including 0), the free runs are in
+     * pages, and the latencies are in TSC cycles. */
+
+    struct Statistics {
+        UIntPtr Runs[PHYS_STAT_BUCKETS], AllocLatency[PHYS_STAT_BUCKETS], FreeLatency[PHYS_STAT_BUCKETS],
+                LargestRun, ContigFailures, EmergencyReclaims, ProactiveReclaims, Compactions, MigratedPages;
+    };
+
+    /* Anything that keeps memory around that it could give back (the heap tail, caches, etc) should register one of
+     * those. Count returns how many pages could be freed right now, and Scan should try freeing up to the given amount
+     * of pages, returning how many were actually freed. Shrinkers with lower priority values are called first (so the
+     * cheaper ones should use the lower values). */
+
+    struct Shrinker {
+        UIntPtr (*Count)();
+        UIntPtr (*Scan)(UIntPtr);
+        UInt8 Priority;
     };
 
     static Void Initialize(BootInfo&);
+    static Void FinishInitialization();
+    static Void RefillZeroPool();
+    static Void InitializeDeferred(UIntPtr = UINTPTR_MAX);
+    static Void SetMovable(UIntPtr, UIntPtr);
+    static Status AddShrinker(const Shrinker&);
+    static Status RemoveShrinker(const Shrinker&);
+    static Void AddNodeRange(UIntPtr, UIntPtr, UInt8);
+    static Void SetLocalNode(UInt8);
 #endif
 
     /* Each one of the functions (allocate/free/reference/dereference) needs three different versions of itself, one
      * for doing said operation on a single page, one for multiple, contiguous, pages, and one for multiple, but
      * non-contiguous, pages. */
 
-    static Status AllocSingle(UIntPtr&, UIntPtr = PAGE_SIZE);
+    static Status AllocSingle(UIntPtr&, UIntPtr = PAGE_SIZE, UInt32 = 0);
     static Status AllocContig(UIntPtr, UIntPtr&, UIntPtr = PAGE_SIZE);
     static Status AllocNonContig(UIntPtr, UIntPtr*, UIntPtr = PAGE_SIZE);
+    static Status AllocHuge(UIntPtr&, UIntPtr = 1);
 
     static Status FreeSingle(UIntPtr);
     static Status FreeContig(UIntPtr, UIntPtr);
     static Status FreeNonContig(UIntPtr*, UIntPtr);
+    static Status FreeHuge(UIntPtr, UIntPtr = 1);
 
-    static Status ReferenceSingle(UIntPtr, UIntPtr&, UIntPtr = PAGE_SIZE);
+    static Status ReferenceSingle(UIntPtr, UIntPtr&, UIntPtr = PAGE_SIZE, UInt32 = 0);
     static Status ReferenceContig(UIntPtr, UIntPtr, UIntPtr&, UIntPtr = PAGE_SIZE);
     static Status ReferenceNonContig(UIntPtr*, UIntPtr, UIntPtr*, UIntPtr = PAGE_SIZE);
 
@@ -93,24 +245,89 @@ public:
     /* Now we also need some helper functions for getting reference count of one page, to get the kernel (physical)
      * start/end, to get the amount of memory the system has, how much has been used, and how much is free. */
 
-    static UInt8 GetReferences(UIntPtr);
+    static UInt32 GetReferences(UIntPtr);
 #ifdef KERNEL
     static inline UIntPtr GetKernelStart() { return KernelStart; }
     static inline UIntPtr GetKernelEnd() { return KernelEnd; }
     static inline UIntPtr GetMinAddress() { return MinAddress; }
     static inline UIntPtr GetMaxAddress() { return MaxAddress; }
     static inline UIntPtr GetSize() { return MaxBytes; }
-    static inline UIntPtr GetUsage() { return UsedBytes; }
-    static inline UIntPtr GetFree() { return MaxBytes - UsedBytes; }
+    static inline UIntPtr GetUsage() { return UsedBytes - CachedBytes - DeferredBytes; }
+    static inline UIntPtr GetFree() { return MaxBytes - UsedBytes + CachedBytes + DeferredBytes; }
+    static inline UIntPtr GetDeferred() { return DeferredBytes; }
+
+    static Void GetStatistics(Statistics&);
+    static UIntPtr GetRunHistogram(UIntPtr, UIntPtr*);
+    static Void PrintStatistics();
+    static UIntPtr GetHugeFree(UIntPtr);
+    static inline UIntPtr GetNodeCount() { return NodeCount; }
+    static inline UInt8 GetLocalNode() { return LocalNode; }
+    static inline UIntPtr GetNodeSize(UInt8 Node) { return Node < NodeCount ? Zones[Node].Size << PAGE_SHIFT : 0; }
+    static inline UIntPtr GetNodeFree(UInt8 Node) { return Node < NodeCount ? Zones[Node].Free << PAGE_SHIFT : 0; }
+    static inline UIntPtr GetNodeFallbacks(UInt8 Node) { return Node < NodeCount ? Zones[Node].Fallbacks : 0; }
 private:
+    static inline UIntPtr GetHugeIndex(UIntPtr Index) {
+        return (((MinAddress >> PAGE_SHIFT) + Index) >> PHYS_HUGE_ORDER) - (MinAddress >> HUGE_PAGE_SHIFT);
+    }
+
+    static inline Magazine &GetMagazine() { return Magazines[0]; }
+    static Status RefillMagazine(Magazine&);
+    static Void DrainMagazine(Magazine&, UIntPtr);
+    static Void DrainMagazines();
+    static Void DrainZeroPool();
+    static Status ZeroPage(UIntPtr);
+    static UIntPtr TakePages(UIntPtr, UIntPtr*);
+    static Void ReleasePages(UIntPtr*, UIntPtr);
+    static Void DeferRange(UIntPtr, UIntPtr);
+
+    static UIntPtr GetBucket(UInt64);
+    static UIntPtr ScanFreeRuns(UIntPtr, UIntPtr, UIntPtr*);
+    static Void PrintHistogram(const Char*, const UIntPtr*);
+
+    static UInt32 ReadReferences(UIntPtr);
+    static Boolean IncrementReferences(UIntPtr);
+    static Boolean DecrementReferences(UIntPtr, Boolean&);
+
+    static Boolean IsMovable(UIntPtr);
+    static Status MigratePage(UIntPtr);
+    static Status Compact(UIntPtr, UIntPtr&, UIntPtr);
+    static UIntPtr Shrink(UIntPtr);
+
+    static Void PushBlock(UIntPtr, UInt8);
+    static Void RemoveBlock(UIntPtr);
+    static Void InsertBlock(UIntPtr, UInt8);
+    static Void InsertRange(UIntPtr, UIntPtr);
+    static Void CarveRange(UIntPtr, UIntPtr);
+    static Status AllocBuddy(UIntPtr, UIntPtr&, UIntPtr);
+    static UIntPtr GetNodeEnd(UIntPtr);
+
+    static UIntPtr FindRegion(UIntPtr);
+    static Void UpdateSummary(UIntPtr);
+    static Void MarkPages(UIntPtr, UIntPtr, Boolean);
+    static Boolean CheckPages(UIntPtr, UIntPtr, Boolean);
     static Status FindFreePages(UIntPtr, UIntPtr, UIntPtr&, UIntPtr&);
+    static Status AllocPages(UIntPtr, UIntPtr&, UIntPtr);
     static Status AllocInt(UIntPtr, UIntPtr&, UIntPtr);
     static Status FreeInt(UIntPtr, UIntPtr);
 
-    static UIntPtr KernelStart, KernelEnd, RegionCount, MinAddress, MaxAddress, MaxBytes, UsedBytes;
+    static UIntPtr KernelStart, KernelEnd, RegionCount, MinAddress, MaxAddress, MaxBytes, UsedBytes, FrameCount,
+                   SummaryCount, CachedBytes, ZeroCount, ZeroPool[PHYS_ZERO_POOL_SIZE], NodeCount,
+                   NodeRangeCount, NodeBounds[PHYS_MAX_NODE_RANGES * 2], NodeBoundCount, ReadyCount,
+                   ReadyAddress, DeferredBytes, DeferredCount, ContigFailures, EmergencyReclaims,
+                   AllocLatency[PHYS_STAT_BUCKETS], FreeLatency[PHYS_STAT_BUCKETS], CompactCursor, Compactions,
+                   MigratedPages, ProactiveReclaims, ShrinkerCount;
+    static UIntPtr *RegionSummary, *TopSummary;
     static Region *Regions;
     static UInt8 *References;
-    static Boolean Initialized;
+    static UInt16 *HugeFree;
+    static Frame *Frames;
+    static Zone Zones[PHYS_MAX_NODES];
+    static NodeRange NodeRanges[PHYS_MAX_NODE_RANGES];
+    static DeferredRange DeferredRanges[PHYS_MAX_DEFERRED_RANGES];
+    static UInt8 LocalNode;
+    static Magazine Magazines[PHYS_MAX_CPUS];
+    static Shrinker Shrinkers[PHYS_MAX_SHRINKERS];
+    static Boolean Initialized, Shrinking, ReclaimBackoff;
 #else
     static UIntPtr GetSize();
     static UIntPtr GetUsage();
@@ -118,27 +335,132 @@ private:
 #endif
 };
 
+/* Unmap doesn't invalidate the TLB entries right away, it only adds the ranges that it unmapped to a batch, and
+ * flushing the batch decides between invalidating each page, or just flushing the whole TLB (when there are more than
+ * TLB_FLUSH_CEILING pages, or more ranges than we can hold). Once we have SMP, this is also what we're going to send
+ * to the other cores. The unmapped pages should only be reused after the flush (the destructor also flushes, so that
+ * we never forget to do it). */
+
+struct TlbRange {
+    UIntPtr Start, End, Step;
+};
+
+class TlbBatch {
+public:
+    TlbBatch() : Ranges(), Count(0), Pages(0) { }
+    ~TlbBatch() { Flush(); }
+
+    Void Add(UIntPtr, UIntPtr, UIntPtr = PAGE_SIZE);
+    Void Flush();
+private:
+    TlbRange Ranges[TLB_BATCH_RANGES];
+    UIntPtr Count, Pages;
+};
+
 class VirtMem {
 public:
 #ifdef KERNEL
     static Void Initialize(BootInfo&);
+    static Void *MapTemp(UIntPtr);
+    static Void UnmapTemp();
 #endif
 
     static Status Query(UIntPtr, UIntPtr&, UInt32&);
     static Status Map(UIntPtr, UIntPtr, UIntPtr, UInt32);
     static Status Unmap(UIntPtr, UIntPtr, Boolean = False);
+    static Status Unmap(UIntPtr, UIntPtr, TlbBatch&, Boolean = False);
 };
 
+#ifdef KERNEL
+/* Each address space has its own top level table, sharing the kernel half with all the others (the kernel half of the
+ * top level is allocated at VirtMem::Initialize, and never changes after that, so copying it is enough), and with the
+ * last entry pointing to itself (so that VirtMem always works on the current address space). The kernel pages are
+ * global, and, if the CPU supports it, each address space also gets a TLB tag (PCID on amd64), so that switching
+ * between them doesn't need to flush the TLB. The tags are handed out once per generation, and running out of them
+ * flushes everything and starts a new generation (the other address spaces get a new tag on their next switch). */
+
+class AddressSpace {
+public:
+    AddressSpace() : Directory(0), Generation(0), Tag(0) { }
+    AddressSpace(const AddressSpace&) = delete;
+    ~AddressSpace();
+
+    AddressSpace &operator =(const AddressSpace&) = delete;
+
+    Status Create();
+    Void Switch();
+
+    static inline AddressSpace &GetKernel() { return Kernel; }
+    static inline AddressSpace &GetCurrent() { return *Current; }
+    inline UIntPtr GetDirectory() const { return Directory; }
+private:
+    UIntPtr Directory, Generation;
+    UInt16 Tag;
+
+    static AddressSpace Kernel, *Current;
+
+    friend class VirtMem;
+};
+#endif
+
+/* Each block of the block allocator (TLSF) starts with this header, followed by the data. PrevPhys is the block just
+ * before this one in memory (the next one is just after the data), and Next/Prev are only valid while the block is
+ * free (they are the first bytes of the data, so the header itself is only ALLOC_BLOCK_HEADER bytes). Free blocks may
+ * also have had the pages inside of their data area unmapped (ALLOC_BLOCK_TRIMMED), the page with the header and the
+ * links always stays mapped. */
+
 struct AllocBlock {
     UIntPtr Magic;
-    UIntPtr Start, Size;
-    UInt64 Pad;
-#ifndef _LP64
-    UInt32 Pad2;
-#endif
+    AllocBlock *PrevPhys;
+    UIntPtr Size, Flags;
     AllocBlock *Next, *Prev;
 };
 
+/* Every slab starts with this header (and the objects start right after it, 16-byte aligned), so that we can find it
+ * just by masking the address of the object. Trimmed slabs are empty slabs that only have the first page mapped, and
+ * the objects that weren't used yet starting at the Clean index are known to be zeroed. Allocated has one bit for
+ * each object that is currently allocated, so that double frees are caught before they corrupt the free list. */
+
+struct SlabHeader {
+    UIntPtr Magic;
+    SlabHeader *Next, *Prev;
+    Void *Free;
+    UInt16 Used, Bump, Capacity, Clean;
+    UInt8 Class;
+    Boolean Trimmed;
+    UIntPtr Allocated[HEAP_SLAB_OBJECTS / HEAP_SLAB_BITMAP_BITS];
+};
+
+/* Large allocations get their own pages (outside of the block heap), and this header goes just before the returned
+ * address (at the start of the first page, or, for aligned allocations, wherever is just before the aligned address),
+ * so that the magic value is always the word just before the data. The free ranges of the large area are kept on a
+ * small sorted array of those ranges (we can't put the links inside of the ranges themselves, as they aren't
+ * mapped). */
+
+struct LargeHeader {
+    UIntPtr Pages, Magic;
+};
+
+struct LargeRange {
+    UIntPtr Start, End;
+};
+
+/* When the heap profiler is enabled, some of the allocations (about one every HEAP_PROFILE_RATE bytes) have their call
+ * stack saved. Each distinct call stack gets one site entry (with the estimated amount of bytes/allocations that it is
+ * responsible for), and each sampled allocation that is still alive gets one sample entry (so that Deallocate can
+ * remove it from the site), those are linked on a small hash table using their indexes. */
+
+struct ProfileSite {
+    UIntPtr Stack[HEAP_PROFILE_DEPTH], Hash, LiveBytes, LiveCount, TotalBytes, TotalCount;
+    UInt8 Depth;
+};
+
+struct ProfileSample {
+    Void *Address;
+    UIntPtr Bytes, Count;
+    UInt16 Site, Next;
+};
+
 class Heap {
 public:
     /* The VirtMem::Initialize (that may be arch-specific, instead of our generic one) will call the init function, and
@@ -147,7 +469,11 @@ public:
 
 #ifdef KERNEL
     static Void Initialize(UIntPtr, UIntPtr);
-    static Void ReturnPhysical();
+    static UIntPtr CountPhysical();
+    static UIntPtr ReturnPhysical(UIntPtr = UINTPTR_MAX);
+    static Void StartProfile(UIntPtr = HEAP_PROFILE_RATE);
+    static Void StopProfile();
+    static Void DumpProfile(UIntPtr = 16);
 #endif
 
     static Status Increment(UIntPtr);
@@ -155,6 +481,9 @@ public:
 
     static Void *Allocate(UIntPtr);
     static Void *Allocate(UIntPtr, UIntPtr);
+    static Void *AllocateUninit(UIntPtr);
+    static Void *AllocateUninit(UIntPtr, UIntPtr);
+    static Void *Reallocate(Void*, UIntPtr);
     static Void Deallocate(Void*);
 
 #ifdef KERNEL
@@ -162,19 +491,79 @@ public:
     static inline Void *GetEnd() { return reinterpret_cast<Void*>(End); }
     static inline Void *GetCurrent() { return reinterpret_cast<Void*>(Current); }
     static inline UIntPtr GetSize() { return End - Start; }
-    static inline UIntPtr GetUsage() { return CurrentAligned - Start; }
-    static inline UIntPtr GetFree() { return End - CurrentAligned; }
+    static inline UIntPtr GetUsage() {
+        return (CurrentAligned - Start) + (SlabTop - SlabBottom) + (LargePages << PAGE_SHIFT);
+    }
+
+    static inline UIntPtr GetFree() { return (SlabBottom - CurrentAligned) + (End - LargeCurrent); }
 private:
+    static inline AllocBlock *GetNext(AllocBlock *Block) {
+        return reinterpret_cast<AllocBlock*>(reinterpret_cast<UIntPtr>(Block) + ALLOC_BLOCK_HEADER + Block->Size);
+    }
+
+    static Void GetIndex(UIntPtr, UIntPtr&, UIntPtr&);
     static Void AddFree(AllocBlock*);
     static Void RemoveFree(AllocBlock*);
-    static Void SplitBlock(AllocBlock*, UIntPtr);
-    static AllocBlock *FuseBlock(AllocBlock*);
+    static AllocBlock *SplitBlock(AllocBlock*, UIntPtr);
+    static Void FuseBlock(AllocBlock*);
+    static Void FreeBlock(AllocBlock*);
+    static Boolean ResizeBlock(AllocBlock*, UIntPtr);
     static AllocBlock *FindBlock(UIntPtr);
     static AllocBlock *CreateBlock(UIntPtr);
+    static Status MapBlock(AllocBlock*, UIntPtr);
+    static UIntPtr ReturnTail(UIntPtr);
+    static UIntPtr TrimBlocks(UIntPtr);
+    static Void *AllocInt(UIntPtr, Boolean);
+    static Void *AllocInt(UIntPtr, UIntPtr, Boolean);
+    static Void *ReallocInt(Void*, UIntPtr);
+
+    static UIntPtr UnmapPages(UIntPtr, UIntPtr);
+    static Status MapSlab(UIntPtr, UIntPtr);
+    static SlabHeader *CreateSlab(UInt8);
+    static Void *AllocSlab(UInt8, Boolean);
+    static Void FreeSlab(SlabHeader*, Void*);
+    static Void AddEmptySlab(SlabHeader*);
+    static Void RemoveSlab(SlabHeader*&, SlabHeader*);
+    static UIntPtr CountSlabs();
+    static UIntPtr ReturnSlabs(UIntPtr);
+
+    static Boolean AddLargeRange(UIntPtr, UIntPtr);
+    static Boolean CarveLargeRange(UIntPtr, UIntPtr, UIntPtr);
+    static UIntPtr FindLarge(UIntPtr, UIntPtr);
+    static Boolean TakeLarge(UIntPtr, UIntPtr);
+    static Status MapLarge(UIntPtr, UIntPtr, Boolean);
+    static Void UnmapLarge(UIntPtr, UIntPtr);
+    static Void *AllocLarge(UIntPtr, UIntPtr, Boolean);
+    static Void FreeLarge(LargeHeader*);
+    static Boolean ResizeLarge(LargeHeader*, UIntPtr);
+
+    /* The sampling check is on the path of every allocation, so it needs to be as cheap as possible: While profiling
+     * is disabled, the countdown is just never reached. */
+
+    static inline always_inline Void *Profile(Void *Address, UIntPtr Size) {
+        if (Address == Null) return Null;
+        else if (Size < ProfileCountdown) ProfileCountdown -= Size;
+        else Sample(Address, Size);
+        return Address;
+    }
+
+    static UIntPtr NextSample();
+    static no_inline Void Sample(Void*, UIntPtr);
+    static Void Unsample(Void*);
 
-    static Boolean Initialized;
-    static AllocBlock *Base, *Tail;
-    static UIntPtr Start, End, Current, CurrentAligned;
+    static const UInt16 SlabSizes[HEAP_SLAB_CLASSES];
+    static Boolean Initialized, Growing;
+    static AllocBlock *Last, *FreeLists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+    static SlabHeader *SlabPartial[HEAP_SLAB_CLASSES], *SlabEmpty, *SlabEmptyTail;
+    static UInt8 SlabIndex[(HEAP_SLAB_MAX >> 4) + 1];
+    static LargeRange LargeFree[HEAP_LARGE_RANGES];
+    static ProfileSite ProfileSites[HEAP_PROFILE_SITES];
+    static ProfileSample ProfileSamples[HEAP_PROFILE_SAMPLES];
+    static UInt16 ProfileBuckets[HEAP_PROFILE_BUCKETS], ProfileFree;
+    static UInt64 ProfileSeed;
+    static UIntPtr Start, End, Current, CurrentAligned, SlabBottom, SlabTop, SlabEmptyPages, FirstMap,
+                   SecondMap[HEAP_FL_COUNT], LargeStart, LargeCurrent, LargePages, LargeFreeCount, ProfileRate,
+                   ProfileCountdown, ProfileLive, ProfileSiteCount, ProfileDropped;
 #else
     static Void *GetStart();
     static Void *GetEnd();
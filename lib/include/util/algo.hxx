@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on March 04 of 2021, at 11:50 BRT
- * Last edited on March 15 of 2021, at 18:06 BRT */
+ * Last edited on October 17 of 2026, at 12:31 BRT */
 
 #pragma once
 
@@ -64,8 +64,9 @@ template<class T, class U> static inline Void MakeHeap(T *Start, UIntPtr Root, U
         UIntPtr i = 2 * Root + 1;
 
         if (i + 1 <= End && Compare(Start[i], Start[i + 1])) i++;
-        if (Compare(Start[Root], Start[i + 1])) Swap(Start[Root], Start[i]);
+        if (!Compare(Start[Root], Start[i])) break;
 
+        Swap(Start[Root], Start[i]);
         Root = i;
     }
 }
@@ -93,19 +94,16 @@ template<class T, class U> Void HeapSort(T *Start, T *End, U Compare) {
 template<class T, class U> T *SortPartition(T *Start, T *End, U Compare) {
     /* Quick sort selection algorithm: Simply iterate from start to end, swapping elements around (based on the
      * condition from the compare function), by the end, we should have everything that satisfies the compare on the
-     * left, and everything that doesn't on the right. */
+     * left, and everything that doesn't on the right (and we return the first element that doesn't satisfy it). */
 
     if (Start >= End) return Start;
 
-    T *i = Start, *j = End - 1;
-
-    for (; i < j;) {
-        for (; Compare(*i); i++);
+    for (T *i = Start, *j = End - 1;;) {
+        for (; i <= j && Compare(*i); i++);
         for (; i < j && !Compare(*j); j--);
-        if (i < j) Swap(*i, *j);
+        if (i >= j) return i;
+        Swap(*i, *j);
     }
-
-    return j;
 }
 
 template<class T, class U> static inline Void Sort(T *Start, T *End, UIntPtr Depth, U Compare) {
@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 07 of 2021, at 21:14 BRT
- * Last edited on March 15 of 2021 at 18:04 BRT */
+ * Last edited on October 17 of 2026 at 20:15 BRT */
 
 #include <vid/img.hxx>
 
@@ -22,10 +22,12 @@ Image::Image(const Image &Source)
     Height(Source.Height) { if (References != Null) (*References)++; }
 
 Image::Image(UInt16 Width, UInt16 Height)
-        : Buffer(new UInt32[Width * Height]), Allocated(True), References(new UIntPtr), Width(Width), Height(Height) {
-    /* We just need to handle the case where the allocation failed (and we have to set everything back to zero. */
+        : Buffer(new UInt32[Width * Height]), Allocated(True), References(new UIntPtr(0)), Width(Width), Height(Height) {
+    /* We just need to handle the case where the allocation failed (and we have to set everything back to zero. ::new
+     * doesn't zero the memory anymore, and nothing draws over the buffer yet, so we have to clear it ourselves. */
 
     if (Buffer == Null) Allocated = False, this->Width = this->Height = 0;
+    else SetMemory(Buffer, 0, Width * Height * sizeof(UInt32));
     if (References != Null) (*References)++;
 }
 
@@ -0,0 +1 @@
+../../../x86/include/arch/cpuid.hxx
\ No newline at end of file
@@ -0,0 +1,16 @@
+/* File author is Ítalo Lima Marconato Matias
+ *
+ * Created on October 17 of 2026, at 23:59 BRT
+ * Last edited on October 17 of 2026, at 23:59 BRT */
+
+#pragma once
+
+#include <base/types.hxx>
+
+namespace CHicago {
+
+static inline Void CpuID(UInt32 Leaf, UInt32 SubLeaf, UInt32 &A, UInt32 &B, UInt32 &C, UInt32 &D) {
+    asm volatile("cpuid" : "=a"(A), "=b"(B), "=c"(C), "=d"(D) : "a"(Leaf), "c"(SubLeaf));
+}
+
+}
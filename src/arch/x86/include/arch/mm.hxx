@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on July 03 of 2020, at 17:28 BRT
- * Last edited on March 05 of 2021, at 13:22 BRT */
+ * Last edited on October 17 of 2026, at 23:59 BRT */
 
 #pragma once
 
@@ -15,6 +15,7 @@
 #define PAGE_WRITE (1 << 1)
 #define PAGE_USER (1 << 2)
 #define PAGE_HUGE (1 << 7)
+#define PAGE_GLOBAL (1 << 8)
 #define PAGE_AOR (1 << 9)
 #define PAGE_COW (1 << 10)
 #ifndef __i386__
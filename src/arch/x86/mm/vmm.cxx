@@ -1,8 +1,9 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 12 of 2021, at 14:54 BRT
- * Last edited on April 14 of 2021, at 17:48 BRT */
+ * Last edited on October 17 of 2026, at 23:59 BRT */
 
+#include <arch/cpuid.hxx>
 #include <arch/mm.hxx>
 #include <sys/mm.hxx>
 #include <sys/panic.hxx>
@@ -15,36 +16,100 @@ using namespace CHicago;
 #define L1_ADDRESS 0xFFFFF000
 #define L2_ADDRESS 0xFFC00000
 #define HEAP_END L2_ADDRESS
+#define TEMP_ADDRESS (HEAP_END - PAGE_SIZE)
 #define DEST_LEVEL(x) (x) ? 1 : 2
 #define USER_FLAG (Virtual >= 0xC0000000 ? 0 : PAGE_USER)
+#define KERNEL_FIRST 0x300
 
 #define GET_INDEXES() UInt16 l1e = (Address >> 22) & 0x3FF, l2e = (Address >> 12) & 0xFFFFF
+#define TABLE_SHIFT 10
 #else
 #define L1_ADDRESS 0xFFFFFFFFFFFFF000
 #define L2_ADDRESS 0xFFFFFFFFFFE00000
 #define L3_ADDRESS 0xFFFFFFFFC0000000
 #define L4_ADDRESS 0xFFFFFF8000000000
-#define HEAP_END L4_ADDRESS
+#define DIRECT_ADDRESS 0xFFFFC00000000000
+#define DIRECT_SIZE (L4_ADDRESS - DIRECT_ADDRESS)
+#define HEAP_END DIRECT_ADDRESS
+#define TEMP_ADDRESS (HEAP_END - PAGE_SIZE)
 #define DEST_LEVEL(x) (x) ? 3 : 4
+#define GIANT_LEVEL 2
 #define USER_FLAG (Virtual >= 0xFFFF800000000000 ? 0 : PAGE_USER)
+#define KERNEL_FIRST 0x100
+#define PCID_COUNT 4096
+#define CR3_NO_FLUSH (1ull << 63)
+#define CR4_PCIDE (1 << 17)
 
 #define GET_INDEXES() \
     UInt64 l1e = (Address >> 39) & 0x1FF, l2e = (Address >> 30) & 0x3FFFF, l3e = (Address >> 21) & 0x7FFFFFF, \
            l4e = (Address >> 12) & 0xFFFFFFFFF
+#define TABLE_SHIFT 9
 #endif
 
+#define CR4_PGE (1 << 7)
+#define GLOBAL_FLAG (GlobalPages && !(USER_FLAG) ? PAGE_GLOBAL : 0)
+
 /* The FULL_CHECK/LAST_CHECK macros are just so that we don't have as much repetition on the CheckDirectory function. */
 
 #define FULL_CHECK(a, i) if ((ret = CheckLevel((a), (i), Entry, Clean)) < 0) return ret; Level++
 #define LAST_CHECK(a, i) return CheckLevel((a), (i), Entry, Clean)
 
+/* Last level entry of the temp mapping window (used by the physical memory manager to access pages that aren't
+ * mapped anywhere, on x86, or outside of the direct map, on amd64). GiantPages is only set if the CPU supports 1GiB
+ * pages (on amd64), GlobalPages if it supports global pages, and PcidEnabled if it supports PCIDs (also only on amd64,
+ * and only if we also have global pages, as we depend on them to flush the other PCIDs). */
+
+static UIntPtr *TempEntry = Null;
+static Boolean GlobalPages = False, PcidEnabled = False;
+
+#ifndef __i386__
+static Boolean GiantPages = False;
+static UIntPtr TagGeneration = 1;
+static UInt16 NextTag = 1;
+#endif
+
+AddressSpace AddressSpace::Kernel, *AddressSpace::Current = &AddressSpace::Kernel;
+
 static inline Void UpdateTLB(UIntPtr Address) { asm volatile("invlpg (%0)" :: "r"(Address) : "memory"); }
 
 static inline UIntPtr GetOffset(UIntPtr Address, UInt8 Level) {
 #ifdef __i386__
     return Address & (Level == 2 ? PAGE_MASK : HUGE_PAGE_MASK);
 #else
-    return Address & (Level == 4 ? PAGE_MASK : (Level == 3 ? HUGE_PAGE_MASK : 0x3FFFFFFF));
+    return Address & (Level == 4 ? PAGE_MASK : (Level == 3 ? HUGE_PAGE_MASK :
+                                                (Level == 2 ? GIANT_PAGE_MASK : 0x7FFFFFFFFF)));
+#endif
+}
+
+static Void FlushAll() {
+    /* Reloading CR3 only flushes the non-global entries (of the current PCID), toggling CR4.PGE flushes everything
+     * (including the global entries and the entries of all the other PCIDs). */
+
+    UIntPtr reg;
+
+    if (!GlobalPages) {
+        asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(reg) :: "memory");
+        return;
+    }
+
+    asm volatile("mov %%cr4, %0" : "=r"(reg));
+    asm volatile("mov %0, %%cr4; mov %1, %%cr4" :: "r"(reg & ~CR4_PGE), "r"(reg) : "memory");
+}
+
+static inline UIntPtr GetWindow(UIntPtr Address, UInt8 Level) {
+    /* Address of the entry for the given address at the given level (inside of the recursive mapping). */
+
+    GET_INDEXES();
+
+#ifdef __i386__
+    return Level == 1 ? L1_ADDRESS + l1e * sizeof(UIntPtr) : L2_ADDRESS + l2e * sizeof(UIntPtr);
+#else
+    switch (Level) {
+    case 1: return L1_ADDRESS + l1e * sizeof(UIntPtr);
+    case 2: return L2_ADDRESS + l2e * sizeof(UIntPtr);
+    case 3: return L3_ADDRESS + l3e * sizeof(UIntPtr);
+    default: return L4_ADDRESS + l4e * sizeof(UIntPtr);
+    }
 #endif
 }
 
@@ -137,36 +202,103 @@ Status VirtMem::Query(UIntPtr Virtual, UIntPtr &Physical, UInt32 &Flags) {
     return Physical = (*ent & ~PAGE_MASK) | GetOffset(Virtual, lvl), Flags = ToFlags(*ent), Status::Success;
 }
 
-static Status DoMap(UIntPtr Virtual, UIntPtr Physical, UInt32 Flags) {
-    /* The caller should handle error out if something is not aligned, and should also convert the map flags into page
-     * flags, so we don't have to do those things here.
-     * Let's just recursively allocate all levels, until we reach the last level (or the huge level). */
+static Status GetEntry(UIntPtr Virtual, UInt8 Level, UIntPtr *&Entry) {
+    /* Let's just recursively allocate all levels, until we reach the level that the caller wants to map something at
+     * (the last level, or the huge level). The caller should check if the entry that we return is free. */
 
     Int8 res;
     Status status;
-    UIntPtr *ent = Null, phys;
-    UInt8 lvl = 1, dlvl = DEST_LEVEL(Flags & PAGE_HUGE);
+    UIntPtr phys;
+    UInt8 lvl = 1;
 
-    while ((res = CheckDirectory(Virtual, ent, lvl)) == -1) {
+    while ((res = CheckDirectory(Virtual, Entry, lvl)) == -1 && lvl < Level) {
         /* The entry doesn't exist, and so we need to allocate this level (alloc a physical address, set it up, and
          * call CheckDirectory again). */
 
-        if (lvl >= dlvl) break;
-        else if ((status = PhysMem::ReferenceSingle(0, phys)) != Status::Success) return status;
+        if ((status = PhysMem::ReferenceSingle(0, phys, PAGE_SIZE, TempEntry != Null ? ALLOC_ZERO : 0)) !=
+            Status::Success) return status;
 
         lvl++;
-        *ent = phys | PAGE_PRESENT | PAGE_WRITE | USER_FLAG;
+        *Entry = phys | PAGE_PRESENT | PAGE_WRITE | USER_FLAG;
+
+        /* Before the temp window is set up, we can't ask for a zeroed page, and we need to clean it ourselves. */
+
+        if (TempEntry == Null) CheckDirectory(Virtual, Entry, lvl, True);
+    }
+
+    /* If we stopped before the level that we wanted (huge page in the way), or went past it (there is a table where
+     * the huge page should go), something is already mapped there. */
+
+    return lvl != Level ? Status::AlreadyMapped : Status::Success;
+}
+
+static Status MapRange(UIntPtr Virtual, UIntPtr Physical, UIntPtr Size, UInt8 Level, UInt32 Flags) {
+    /* Now we can just iterate over the size, while mapping everything (and breaking out if something goes wrong). We
+     * only need to walk the directory once per table: the entries for the next pages are just the next entries of the
+     * same table, until we cross into the next one. If the address is already mapped, just error out (let's not even
+     * try remapping it). */
+
+    UIntPtr step = GetOffset(UINTPTR_MAX, Level) + 1, span = (step << TABLE_SHIFT) - 1, *ent;
+    Status status;
+
+    for (UIntPtr i = 0; i < Size;) {
+        if ((status = GetEntry(Virtual + i, Level, ent)) != Status::Success) return status;
+
+        do {
+            if (*ent & PAGE_PRESENT) return Status::AlreadyMapped;
+            *ent++ = (Physical + i) | Flags;
+        } while ((i += step) < Size && ((Virtual + i) & span));
+    }
+
+    return Status::Success;
+}
+
+static Status MapAuto(UIntPtr Virtual, UIntPtr Physical, UIntPtr Size, UInt8 Level, UInt32 Flags) {
+    /* If the virtual and the physical addresses are congruent (modulo the page size of this level), we can use pages
+     * of this level for everything between the first and the last boundaries, and the next (smaller) level only for
+     * the head and the tail of the range. A slot that already has a table (maybe from some old mapping, as Unmap
+     * doesn't free the tables) goes to the next level as well. */
+
+    UIntPtr mask = GetOffset(UINTPTR_MAX, Level), start = (Virtual + mask) & ~mask, end = (Virtual + Size) & ~mask;
+    UInt8 last = DEST_LEVEL(False);
+    Status status;
 
-        CheckDirectory(Virtual, ent, lvl, True);
+    if (Level >= last) return MapRange(Virtual, Physical, Size, last, Flags);
+    else if (((Virtual ^ Physical) & mask) || start < Virtual || end <= start) {
+        return MapAuto(Virtual, Physical, Size, Level + 1, Flags);
+    } else if ((status = MapAuto(Virtual, Physical, start - Virtual, Level + 1, Flags)) != Status::Success) {
+        return status;
     }
 
-    /* If the address is already mapped, just error out (let's not even try remapping it). */
+    for (UIntPtr cur = start; cur < end; cur += mask + 1) {
+        UIntPtr phys = Physical + (cur - Virtual);
 
-    if (res != -1 || lvl > dlvl) return Status::AlreadyMapped;
-    return *ent = Physical | Flags, Status::Success;
+        if ((status = MapRange(cur, phys, mask + 1, Level, Flags | PAGE_HUGE)) == Status::AlreadyMapped) {
+            status = MapAuto(cur, phys, mask + 1, Level + 1, Flags);
+        }
+
+        if (status != Status::Success) return status;
+    }
+
+    return MapAuto(end, Physical + (end - Virtual), Virtual + Size - end, Level + 1, Flags);
 }
 
 Status VirtMem::Map(UIntPtr Virtual, UIntPtr Physical, UIntPtr Size, UInt32 Flags) {
+    /* 1GiB pages are only available on amd64 (and only if the CPU supports them). */
+
+    if (Flags & MAP_GIANT) {
+#ifdef __i386__
+        return Status::Unsupported;
+#else
+        if (!GiantPages) return Status::Unsupported;
+        else if ((Virtual & GIANT_PAGE_MASK) || (Physical & GIANT_PAGE_MASK) || (Size & GIANT_PAGE_MASK)) {
+            return Status::InvalidArg;
+        }
+
+        return MapRange(Virtual, Physical, Size, GIANT_LEVEL, FromFlags(Flags | MAP_HUGE) | GLOBAL_FLAG);
+#endif
+    }
+
     /* Check if everything is properly aligned (including the size). */
 
     if (((Flags & MAP_HUGE) && ((Virtual & HUGE_PAGE_MASK) || (Physical & HUGE_PAGE_MASK) || (Size & HUGE_PAGE_MASK)))
@@ -174,61 +306,311 @@ Status VirtMem::Map(UIntPtr Virtual, UIntPtr Physical, UIntPtr Size, UInt32 Flag
         return Status::InvalidArg;
     }
 
-    /* Now we can just iterate over the size, while mapping everything (and breaking out if something goes wrong). */
+    /* Explicit huge mappings can go straight to MapRange, everything else goes through MapAuto, starting with the
+     * biggest page size that we have. The kernel half is the same on all address spaces, so it can be global. */
+
+    UInt8 lvl = DEST_LEVEL(True);
 
+    if (Flags & MAP_HUGE) return MapRange(Virtual, Physical, Size, lvl, FromFlags(Flags) | GLOBAL_FLAG);
+
+#ifndef __i386__
+    if (GiantPages) lvl = GIANT_LEVEL;
+#endif
+
+    return MapAuto(Virtual, Physical, Size, lvl, FromFlags(Flags) | GLOBAL_FLAG);
+}
+
+static Status SplitHuge(UIntPtr Virtual, UIntPtr *Entry, UInt8 Level) {
+    /* Demote a huge/giant page into a table of pages of the next level (with the same flags), so that the caller can
+     * unmap only part of it. The table is filled using the temp window before we replace the entry, so that the range
+     * never goes unmapped (the stack or the code that is running might be inside of it). Other than the page itself,
+     * the TLB might also have the entries window of the next level pointing to the old page. */
+
+    UIntPtr mask = GetOffset(UINTPTR_MAX, Level), step = GetOffset(UINTPTR_MAX, Level + 1) + 1,
+            base = *Entry & ~mask, flags = *Entry & PAGE_MASK, phys, *table;
+    UInt8 last = DEST_LEVEL(False);
     Status status;
 
-    for (UIntPtr i = 0; i < Size; i += (Flags & MAP_HUGE) ? HUGE_PAGE_SIZE : PAGE_SIZE) {
-        if ((status = DoMap(Virtual + i, Physical + i, FromFlags(Flags))) != Status::Success) return status;
+    if (Level + 1 == last) flags &= ~PAGE_HUGE;
+
+#ifndef __i386__
+    base &= ~PAGE_NO_EXEC;
+    flags |= *Entry & PAGE_NO_EXEC;
+#endif
+
+    if ((status = PhysMem::ReferenceSingle(0, phys)) != Status::Success) return status;
+    else if ((table = static_cast<UIntPtr*>(VirtMem::MapTemp(phys))) == Null) {
+        PhysMem::DereferenceSingle(phys);
+        return Status::OutOfMemory;
     }
 
+    for (UIntPtr i = 0; i < 1 << TABLE_SHIFT; i++) table[i] = (base + i * step) | flags;
+
+    VirtMem::UnmapTemp();
+
+    *Entry = phys | PAGE_PRESENT | PAGE_WRITE | USER_FLAG;
+
+    /* The window entries aren't global, and invlpg only invalidates them for the current PCID. That's enough for the
+     * user half (only the current address space has those tables), but on the kernel half the other address spaces
+     * might have cached them as well. */
+
+    if (PcidEnabled && !(USER_FLAG)) {
+        FlushAll();
+        return Status::Success;
+    }
+
+    UpdateTLB(Virtual & ~mask);
+    UpdateTLB(GetWindow(Virtual, Level + 1) & ~PAGE_MASK);
+
     return Status::Success;
 }
 
-static Status DoUnmap(UIntPtr Virtual, Boolean Huge) {
-    /* Just go though the directory levels, searching for what we want to unmap (no need to check for alignment, as
-     * the caller should have done it). */
+Void TlbBatch::Add(UIntPtr Start, UIntPtr Size, UIntPtr Step) {
+    /* Contiguous ranges (with the same page size) are merged, and after we go past TLB_FLUSH_CEILING pages, we're
+     * going to flush everything anyways, so there is no need to save the ranges anymore. */
 
-    UIntPtr *ent;
-    UInt8 lvl = 1, dlvl = DEST_LEVEL(Huge);
+    TlbRange *last = Count ? &Ranges[Count - 1] : Null;
 
-    if (CheckDirectory(Virtual, ent, lvl) == -1) return Status::NotMapped;
-    else if (lvl != dlvl) return Status::InvalidArg;
+    if (!Size) return;
+    else if (Pages <= TLB_FLUSH_CEILING) {
+        if (last != Null && last->End == Start && last->Step == Step) last->End += Size;
+        else if (Count < TLB_BATCH_RANGES) Ranges[Count++] = { Start, Start + Size, Step };
+        else Pages = TLB_FLUSH_CEILING;
+    }
 
-    *ent &= ~PAGE_PRESENT;
-    UpdateTLB(Virtual);
+    Pages += (Size + Step - 1) / Step;
+}
 
-    return Status::Success;
+Void TlbBatch::Flush() {
+    /* invlpg is serializing, so after some amount of pages, it's cheaper to just flush everything and take the misses
+     * (invlpg also invalidates global pages, so we need to do the same). */
+
+    if (!Pages) return;
+    else if (Pages > TLB_FLUSH_CEILING) FlushAll();
+    else {
+        for (UIntPtr i = 0; i < Count; i++) {
+            for (UIntPtr cur = Ranges[i].Start; cur < Ranges[i].End; cur += Ranges[i].Step) UpdateTLB(cur);
+        }
+    }
+
+    Count = Pages = 0;
 }
 
 Status VirtMem::Unmap(UIntPtr Virtual, UIntPtr Size, Boolean Huge) {
-    /* Check for the right alignment, and redirect to Unmap(UIntPtr, Boolean), while iterating over the size. */
+    /* Unmap everything into our own batch, and flush it right away. */
+
+    TlbBatch batch;
+    Status status = Unmap(Virtual, Size, batch, Huge);
+
+    batch.Flush();
+
+    return status;
+}
+
+Status VirtMem::Unmap(UIntPtr Virtual, UIntPtr Size, TlbBatch &Batch, Boolean Huge) {
+    /* Check for the right alignment, and go though the directory levels, searching for what we want to unmap. Just
+     * like Map, we only walk the directory again when we cross into the next table. The invalidation is left to the
+     * caller (using the batch), only demoting pages needs to invalidate things right away. */
 
     if ((Huge && (Virtual & HUGE_PAGE_MASK)) || (!Huge && (Virtual & PAGE_MASK))) return Status::InvalidArg;
 
+    UIntPtr step = Huge ? HUGE_PAGE_SIZE : PAGE_SIZE, span = (step << TABLE_SHIFT) - 1, *ent;
+    UInt8 dlvl = DEST_LEVEL(Huge);
     Status status;
 
-    for (UIntPtr i = 0; i < Size; i += Huge ? HUGE_PAGE_SIZE : PAGE_SIZE) {
-        if ((status = DoUnmap(Virtual + i, Huge)) != Status::Success) return status;
+    for (UIntPtr i = 0; i < Size;) {
+        UInt8 lvl = 1;
+
+        if (CheckDirectory(Virtual + i, ent, lvl) == -1) return Status::NotMapped;
+        else if (lvl < dlvl) {
+            /* Map might have promoted part of the range into a bigger page. If we're unmapping all of it, just unmap
+             * it as a whole, else, demote it (one level at a time) and try again. */
+
+            UIntPtr size = GetOffset(UINTPTR_MAX, lvl) + 1;
+
+            if (!((Virtual + i) & (size - 1)) && Size - i >= size) {
+                *ent &= ~PAGE_PRESENT;
+                Batch.Add(Virtual + i, size, size);
+                i += size;
+            } else if ((status = SplitHuge(Virtual + i, ent, lvl)) != Status::Success) return status;
+
+            continue;
+        } else if (lvl != dlvl) return Status::InvalidArg;
+
+        do {
+            if (!(*ent & PAGE_PRESENT)) return Status::NotMapped;
+            else if (Huge && !(*ent & PAGE_HUGE)) return Status::InvalidArg;
+
+            *ent++ &= ~PAGE_PRESENT;
+            Batch.Add(Virtual + i, step, step);
+        } while ((i += step) < Size && ((Virtual + i) & span));
     }
 
     return Status::Success;
 }
 
+Void *VirtMem::MapTemp(UIntPtr Physical) {
+    /* Pages inside of the direct map can just be used from there (without touching the TLB). Else, there is only one
+     * window (and no SMP yet), so the caller needs to UnmapTemp before mapping anything else. */
+
+    if (TempEntry == Null || (Physical & PAGE_MASK)) return Null;
+
+#ifndef __i386__
+    UIntPtr phys;
+    UInt32 flags;
+
+    if (Physical < DIRECT_SIZE && Query(DIRECT_ADDRESS + Physical, phys, flags) == Status::Success) {
+        return reinterpret_cast<Void*>(DIRECT_ADDRESS + Physical);
+    }
+#endif
+
+    *TempEntry = Physical | FromFlags(MAP_RW);
+    UpdateTLB(TEMP_ADDRESS);
+
+    return reinterpret_cast<Void*>(TEMP_ADDRESS);
+}
+
+Void VirtMem::UnmapTemp() {
+    if (TempEntry == Null || !*TempEntry) return;
+
+    *TempEntry = 0;
+    UpdateTLB(TEMP_ADDRESS);
+}
+
+static Void FreeTables(UIntPtr Address, UInt8 Level, UIntPtr Count) {
+    /* Free all the tables under Count entries of this level (starting with the one for Address), on the current
+     * address space. The pages that are still mapped aren't ours to free (whoever mapped them owns them). */
+
+    UIntPtr step = GetOffset(UINTPTR_MAX, Level) + 1, *ent = reinterpret_cast<UIntPtr*>(GetWindow(Address, Level));
+    UInt8 last = DEST_LEVEL(False);
+
+    for (UIntPtr i = 0; i < Count; i++, Address += step) {
+        if (!(ent[i] & PAGE_PRESENT) || (ent[i] & PAGE_HUGE)) continue;
+        else if (Level + 1 < last) FreeTables(Address, Level + 1, 1 << TABLE_SHIFT);
+
+        PhysMem::DereferenceSingle(ent[i] & ~PAGE_MASK);
+    }
+}
+
+AddressSpace::~AddressSpace() {
+    /* We can only walk the tables of the current address space (using the recursive mapping), so switch into this one
+     * (the kernel half is the same, so we can keep running), free the tables of the user half, and switch back. Our
+     * tag is only handed out again after the next full flush, so the stale entries with it don't matter. */
+
+    if (!Directory || this == &Kernel) return;
+
+    AddressSpace *old = Current != this ? Current : &Kernel;
+
+    Switch();
+    FreeTables(0, 1, KERNEL_FIRST);
+    old->Switch();
+
+    PhysMem::DereferenceSingle(Directory);
+}
+
+Status AddressSpace::Create() {
+    /* The kernel half is copied from the current top level table (all of its entries were allocated at
+     * VirtMem::Initialize), the user half starts empty, and the last entry is the recursive mapping. */
+
+    if (Directory) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid AddressSpace::Create call (the address space was already created)\n");
+        Debug.RestoreForeground();
+        return Status::InvalidArg;
+    }
+
+    UIntPtr phys, *table, *cur = reinterpret_cast<UIntPtr*>(L1_ADDRESS);
+    Status status;
+
+    if ((status = PhysMem::ReferenceSingle(0, phys, PAGE_SIZE, ALLOC_ZERO)) != Status::Success) return status;
+    else if ((table = static_cast<UIntPtr*>(VirtMem::MapTemp(phys))) == Null) {
+        PhysMem::DereferenceSingle(phys);
+        return Status::OutOfMemory;
+    }
+
+    CopyMemory(&table[KERNEL_FIRST], &cur[KERNEL_FIRST], ((1 << TABLE_SHIFT) - KERNEL_FIRST - 1) * sizeof(UIntPtr));
+    table[(1 << TABLE_SHIFT) - 1] = phys | PAGE_PRESENT | PAGE_WRITE;
+    VirtMem::UnmapTemp();
+
+    Directory = phys;
+    Generation = 0;
+
+    return Status::Success;
+}
+
+Void AddressSpace::Switch() {
+    /* Without PCIDs, writing CR3 flushes all the non-global entries (but the kernel pages stay). With them, we keep the
+     * entries of all the address spaces, and only flush our own tag when we just got it (the kernel always uses tag
+     * 0). Running out of tags flushes everything, and the other address spaces will get a new tag when they are
+     * switched into. */
+
+    if (this == Current || !Directory) return;
+
+    UIntPtr cr3 = Directory;
+
+#ifndef __i386__
+    if (PcidEnabled) {
+        UIntPtr keep = CR3_NO_FLUSH;
+
+        if (this != &Kernel && Generation != TagGeneration) {
+            if (NextTag >= PCID_COUNT) {
+                FlushAll();
+                TagGeneration++;
+                NextTag = 1;
+            }
+
+            Tag = NextTag++;
+            Generation = TagGeneration;
+            keep = 0;
+        }
+
+        cr3 |= Tag | keep;
+    }
+#endif
+
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    Current = this;
+}
+
 Void VirtMem::Initialize(BootInfo &Info) {
     /* Generic initialization function: We need to unmap the EFI jump function, and we need pre-alloc the first level of
      * the heap region (and we can't fail, if we do fail, panic, as the rest of the OS depends on us), and call the heap
      * init function. Also, we expect that adding HUGE_PAGE_MASK will be enough to make sure that we don't collide with
      * some huge mapping from the kernel/bootloader. */
 
-    UIntPtr start = (Info.KernelEnd + HUGE_PAGE_MASK) & ~HUGE_PAGE_MASK;
+    UIntPtr start = (Info.KernelEnd + HUGE_PAGE_MASK) & ~HUGE_PAGE_MASK, cr3, cr4;
+    UInt32 a, b, c, d;
 
     Unmap(Info.EfiTempAddress & ~PAGE_MASK, PAGE_SIZE);
 
+    /* Enable global pages and PCIDs before mapping anything else (so that everything that we map is already global).
+     * PCIDs can only be enabled while the current PCID is 0 (the low bits of CR3 are the PCID after that). */
+
+    CpuID(1, 0, a, b, c, d);
+    GlobalPages = (d >> 13) & 1;
+
+    asm volatile("mov %%cr3, %0; mov %%cr4, %1" : "=r"(cr3), "=r"(cr4));
+    cr3 &= ~PAGE_MASK;
+
+    if (GlobalPages) cr4 |= CR4_PGE;
+
+#ifndef __i386__
+    if ((PcidEnabled = GlobalPages && ((c >> 17) & 1))) {
+        asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+        cr4 |= CR4_PCIDE;
+    }
+#endif
+
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    AddressSpace::Kernel.Directory = cr3;
+
+    /* The whole kernel half of the top level needs to be allocated here, as the other address spaces only copy it once
+     * (when they are created). On amd64, that includes the direct map. */
+
 #ifdef __i386__
     for (UIntPtr i = start & ~HUGE_PAGE_MASK; i < HEAP_END; i += HUGE_PAGE_SIZE) {
 #else
-    for (UIntPtr i = start & ~0x7FFFFFFFFF; i < HEAP_END; i += 0x8000000000) {
+    for (UIntPtr i = start & ~0x7FFFFFFFFF; i < L4_ADDRESS; i += 0x8000000000) {
 #endif
         UInt8 lvl = 1;
         UIntPtr *ent, phys;
@@ -241,6 +623,58 @@ Void VirtMem::Initialize(BootInfo &Info) {
         CheckDirectory(i, ent, lvl, True);
     }
 
-    Heap::Initialize(start, HEAP_END);
-    Debug.Write("the kernel heap starts at 0x{:0*:16} and ends at 0x{:0*:16}\n", start, HEAP_END);
+    /* The last page before the heap end is the temp mapping window, map it once (so that all the levels get
+     * allocated), and save the last level entry, so that MapTemp only needs to change it. */
+
+    UIntPtr *ent;
+    UInt8 lvl = 1;
+
+    ASSERT(Map(TEMP_ADDRESS, 0, PAGE_SIZE, MAP_RW) == Status::Success);
+    ASSERT(CheckDirectory(TEMP_ADDRESS, ent, lvl) == 0);
+
+    TempEntry = ent;
+    UnmapTemp();
+
+#ifndef __i386__
+    /* On amd64, we also have a direct map of the usable RAM (the free entries of the memory map, which is where all the
+     * pages that PhysMem hands out come from), just after the heap end. Everything else (reserved/ACPI ranges, MMIO,
+     * the framebuffer) is left out, as a write-back alias of those would conflict with their memory type (and the CPU
+     * could speculatively access them through it). Adjacent free entries are mapped together, so that Map can use
+     * bigger pages for them (1GiB pages, if the CPU supports them). We can live without it (MapTemp still works), so
+     * just warn if something goes wrong. */
+
+    UIntPtr base = 0, end = 0, size = 0;
+
+    CpuID(0x80000000, 0, a, b, c, d);
+
+    if (a >= 0x80000001) {
+        CpuID(0x80000001, 0, a, b, c, d);
+        GiantPages = (d >> 26) & 1;
+    }
+
+    for (UIntPtr i = 0; i <= Info.MemoryMap.Count; i++) {
+        BootInfoMemMap *mem = i < Info.MemoryMap.Count ? &Info.MemoryMap.Entries[i] : Null;
+
+        if (mem != Null && ((i && !mem->Base) || mem->Type != BOOT_INFO_MEM_FREE)) continue;
+        else if (mem != Null && mem->Base == end) {
+            end += mem->Count << PAGE_SHIFT;
+            continue;
+        } else if (end > DIRECT_SIZE) end = DIRECT_SIZE;
+
+        if (base < end && Map(DIRECT_ADDRESS + base, base, end - base, MAP_RW) != Status::Success) {
+            Debug.SetForeground(0xFFFF0000);
+            Debug.Write("couldn't map 0x{:0*:16} - 0x{:0*:16} into the direct map\n", base, end);
+            Debug.RestoreForeground();
+        } else if (base < end) size += end - base;
+
+        if (mem != Null) base = mem->Base, end = base + (mem->Count << PAGE_SHIFT);
+    }
+
+    Debug.Write("mapped 0x{:0:16} bytes into the direct map at 0x{:0*:16} ({}using 1GiB pages)\n", size,
+                DIRECT_ADDRESS, GiantPages ? "" : "not ");
+#endif
+
+    Heap::Initialize(start, TEMP_ADDRESS);
+    Debug.Write("the kernel heap starts at 0x{:0*:16} and ends at 0x{:0*:16}\n", start, TEMP_ADDRESS);
+    Debug.Write("{}using global pages, {}using PCIDs\n", GlobalPages ? "" : "not ", PcidEnabled ? "" : "not ");
 }
@@ -1,8 +1,9 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 06 of 2021, at 12:47 BRT
- * Last edited on April 10 of 2021, at 17:06 BRT */
+ * Last edited on October 17 of 2026, at 23:59 BRT */
 
+#include <arch/cpuid.hxx>
 #include <arch/desctables.hxx>
 #include <sys/arch.hxx>
 #include <vid/console.hxx>
@@ -20,6 +21,32 @@ Void Arch::Initialize(BootInfo&) {
     Debug.Write("initialized the interrupt descriptor table\n");
 }
 
+UInt32 Arch::GetCoreID() {
+    /* The core ID is the (x2)APIC ID, which is what the ACPI tables use to identify each processor. Prefer the full
+     * x2APIC ID from leaf 0x0B (if it is supported), and fallback to the 8-bit initial APIC ID from leaf 0x01. */
+
+    UInt32 a, b, c, d;
+
+    CpuID(0, 0, a, b, c, d);
+
+    if (a >= 0x0B) {
+        CpuID(0x0B, 0, a, b, c, d);
+        if (b) return d;
+    }
+
+    return CpuID(1, 0, a, b, c, d), b >> 24;
+}
+
+UInt64 Arch::GetTimestamp() {
+    /* This is just the raw TSC value (in cycles, not in any actual time unit), which is enough for measuring how long
+     * something took. */
+
+    UInt32 low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return (static_cast<UInt64>(high) << 32) | low;
+}
+
 no_return Void Arch::Halt(Boolean Full) {
     if (Full) while (True) asm volatile("cli; hlt");
     else while (True) asm volatile("hlt");
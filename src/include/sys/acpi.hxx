@@ -1,12 +1,20 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on March 11 of 2021, at 17:50 BRT
- * Last edited on March 11 of 2021 at 18:58 BRT */
+ * Last edited on October 17 of 2026 at 14:35 BRT */
 
 #pragma once
 
 #include <base/types.hxx>
 
+#define ACPI_MAX_DOMAINS 8
+
+#define SRAT_PROCESSOR 0
+#define SRAT_MEMORY 1
+#define SRAT_X2APIC 2
+
+#define SRAT_ENABLED 0x01
+
 namespace CHicago {
 
 struct packed BootInfo;
@@ -21,7 +29,46 @@ public:
         UInt32 OemRevision, CreatorID, CreatorRevision;
     };
 
+    /* The SRAT (System Resource Affinity Table) tells us which proximity domain (NUMA node) each processor and each
+     * memory range belongs to. All the entries start with the type and length fields. */
+
+    struct packed SratHeader {
+        SdtHeader Header;
+        UInt32 Reserved0;
+        UInt64 Reserved1;
+    };
+
+    struct packed SratProcessor {
+        UInt8 Type, Length, DomainLow, ApicID;
+        UInt32 Flags;
+        UInt8 SapicEID, DomainHigh[3];
+        UInt32 ClockDomain;
+    };
+
+    struct packed SratMemory {
+        UInt8 Type, Length;
+        UInt32 Domain;
+        UInt16 Reserved0;
+        UInt64 Base, Size;
+        UInt32 Reserved1, Flags;
+        UInt64 Reserved2;
+    };
+
+    struct packed SratX2Apic {
+        UInt8 Type, Length;
+        UInt16 Reserved0;
+        UInt32 Domain, ApicID, Flags, ClockDomain, Reserved1;
+    };
+
     static Void Initialize(BootInfo&);
+private:
+    static Void ReadPhysical(UIntPtr, Void*, UIntPtr);
+    static SdtHeader *LoadTable(UIntPtr);
+    static UInt8 GetNode(UInt32);
+    static Void ParseSrat(SdtHeader*);
+
+    static UInt32 Domains[ACPI_MAX_DOMAINS];
+    static UIntPtr DomainCount;
 };
 
 }
@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 06 of 2021, at 12:46 BRT
- * Last edited on March 11 of 2021 at 16:11 BRT */
+ * Last edited on October 17 of 2026 at 15:40 BRT */
 
 #pragma once
 
@@ -17,6 +17,8 @@ public:
 
     static Void Sleep(UInt64);
     static UInt64 GetUpTime();
+    static UInt64 GetTimestamp();
+    static UInt32 GetCoreID();
 };
 
 }
@@ -1,13 +1,14 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 05 of 2021, at 20:33 BRT
- * Last edited on March 14 of 2021 at 11:11 BRT */
+ * Last edited on October 17 of 2026 at 23:59 BRT */
 
 #pragma once
 
 #include <sys/acpi.hxx>
 
 #define BOOT_INFO_MAGIC 0xC4057D41
+#define BOOT_INFO_MEM_FREE 0x06
 
 namespace CHicago {
 
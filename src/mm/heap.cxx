@@ -1,25 +1,56 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 14 of 2021, at 23:45 BRT
- * Last edited on March 10 of 2021, at 17:11 BRT */
+ * Last edited on October 17 of 2026, at 23:59 BRT */
 
 #include <sys/mm.hxx>
 #include <sys/panic.hxx>
+#include <util/bitop.hxx>
 
 using namespace CHicago;
 
-Boolean Heap::Initialized = False;
-AllocBlock *Heap::Base = Null, *Heap::Tail = Null;
-UIntPtr Heap::Start = 0, Heap::End = 0, Heap::Current = 0, Heap::CurrentAligned = 0;
+const UInt16 Heap::SlabSizes[HEAP_SLAB_CLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536,
+                                                     2048 };
+Boolean Heap::Initialized = False, Heap::Growing = False;
+AllocBlock *Heap::Last = Null, *Heap::FreeLists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+SlabHeader *Heap::SlabPartial[HEAP_SLAB_CLASSES], *Heap::SlabEmpty = Null, *Heap::SlabEmptyTail = Null;
+UInt8 Heap::SlabIndex[(HEAP_SLAB_MAX >> 4) + 1];
+LargeRange Heap::LargeFree[HEAP_LARGE_RANGES];
+UIntPtr Heap::Start = 0, Heap::End = 0, Heap::Current = 0, Heap::CurrentAligned = 0, Heap::SlabBottom = 0,
+        Heap::SlabTop = 0, Heap::SlabEmptyPages = 0, Heap::FirstMap = 0, Heap::SecondMap[HEAP_FL_COUNT],
+        Heap::LargeStart = 0, Heap::LargeCurrent = 0, Heap::LargePages = 0, Heap::LargeFreeCount = 0;
 
 Void Heap::Initialize(UIntPtr Start, UIntPtr End) {
     ASSERT(!Initialized);
     ASSERT(Start != End);
     ASSERT(Start >= PhysMem::GetMinAddress() && End >= PhysMem::GetMinAddress());
 
+    /* The last part of the heap (1/2^HEAP_LARGE_SHIFT of it, starting at a huge page boundary) is reserved for the
+     * large allocations, which get their own pages (so that they don't fragment the block heap, and so that they can
+     * be given back to PhysMem as soon as they are freed). */
+
     Heap::Start = Current = CurrentAligned = Start;
     Heap::End = End;
+    LargeStart = LargeCurrent = (End - ((End - Start) >> HEAP_LARGE_SHIFT)) & ~HUGE_PAGE_MASK;
+    SlabBottom = SlabTop = LargeStart & ~HEAP_SLAB_MASK;
     Initialized = True;
+
+    ASSERT(SlabBottom > Start);
+
+    /* The small allocations (up to HEAP_SLAB_MAX bytes) are handled by the slab allocator, which grows downwards from
+     * the start of the large area (while the block allocator grows upwards from the start of the heap). Build the
+     * size (in 16-byte units) to size class table, so that finding the class is just a lookup. */
+
+    for (UIntPtr i = 0, cls = 0; i <= HEAP_SLAB_MAX >> 4; i++) {
+        while (SlabSizes[cls] < (i << 4)) cls++;
+        SlabIndex[i] = cls;
+    }
+
+    /* The pages between Current and CurrentAligned are the cheapest thing to give back when the system is running
+     * low on memory, so register ourselves with the lowest priority value (the empty slabs come right after). */
+
+    PhysMem::AddShrinker({ CountPhysical, ReturnPhysical, 0 });
+    PhysMem::AddShrinker({ CountSlabs, ReturnSlabs, 1 });
 }
 
 Status Heap::Increment(UIntPtr Amount) {
@@ -27,22 +58,36 @@ Status Heap::Increment(UIntPtr Amount) {
 	 * we aren't trying to expand beyond the heap limit. */
 
     if (!Initialized || !Amount) return Status::InvalidArg;
-    else if ((Current + Amount) < Current || (Current + Amount) >= End) return Status::OutOfMemory;
+    else if ((Current + Amount) < Current || (Current + Amount) >= SlabBottom) return Status::OutOfMemory;
 
 	/* Now, we need to expand the heap, but this is not just a matter of increasing the Heap::Current variable, as we
 	 * need to make sure that the space we're expanding into is going to be mapped into the memory. */
 	
 	UIntPtr nw = Current + Amount, phys;
-	Status status;
+	Status status = Status::Success;
+
+	/* The allocations below may end up calling the shrinkers, and ReturnPhysical can't touch CurrentAligned while
+	 * we're still using it. */
+
+	Growing = True;
 
 	for (; CurrentAligned < nw; CurrentAligned += PAGE_SIZE) {
-		if ((status = PhysMem::ReferenceSingle(0, phys)) != Status::Success) return status;
+		if ((status = PhysMem::ReferenceSingle(0, phys, PAGE_SIZE, ALLOC_ZERO)) != Status::Success) break;
 		else if ((status = VirtMem::Map(CurrentAligned, phys, PAGE_SIZE, MAP_RW)) != Status::Success) {
 			PhysMem::DereferenceSingle(phys);
-			return status;
+			break;
 		}
+
+		/* Nobody else knows about the physical address of the heap pages, so they can be moved around by the
+		 * compaction. */
+
+		PhysMem::SetMovable(phys, CurrentAligned);
 	}
 
+	Growing = False;
+
+	if (status != Status::Success) return status;
+
     return Current = nw, Status::Success;
 }
 
@@ -50,240 +95,975 @@ Void Heap::Decrement(UIntPtr Amount) {
     if (Initialized && (Current - Amount) < Current && (Current - Amount) >= Start) Current -= Amount;
 }
 
-Void Heap::ReturnPhysical() {
-    /* This function actually returns all the allocated PHYSICAL memory to the system (the system may call us if it is
-     * running out of memory, or regularly to not let the waste accumulate). */
+UIntPtr Heap::CountPhysical() {
+    /* Everything between the (page aligned) end of the heap and CurrentAligned is mapped but unused, and so are the
+     * pages fully inside of the free blocks (we only count the blocks that weren't trimmed yet, as we would need to
+     * check each page of the trimmed ones). */
+
+    if (!Initialized || Growing) return 0;
+
+    UIntPtr count = (CurrentAligned - ((Current + PAGE_MASK) & ~PAGE_MASK)) >> PAGE_SHIFT, fl, sl;
 
-    if (!Initialized) return;
+    GetIndex(PAGE_SIZE, fl, sl);
+
+    for (; fl < HEAP_FL_COUNT; fl++) {
+        for (sl = 0; sl < HEAP_SL_COUNT; sl++) {
+            for (AllocBlock *blk = FreeLists[fl][sl]; blk != Null; blk = blk->Next) {
+                UIntPtr start = (reinterpret_cast<UIntPtr>(blk) + sizeof(AllocBlock) + PAGE_MASK) & ~PAGE_MASK,
+                        end = reinterpret_cast<UIntPtr>(GetNext(blk)) & ~PAGE_MASK;
+                if (!(blk->Flags & ALLOC_BLOCK_TRIMMED) && start < end) count += (end - start) >> PAGE_SHIFT;
+            }
+        }
+    }
+
+    return count;
+}
 
-    for (; CurrentAligned - PAGE_SIZE >= Current;) {
+UIntPtr Heap::ReturnPhysical(UIntPtr Pages) {
+    /* This function actually returns the allocated (but unused) PHYSICAL memory to the system (PhysMem calls us
+     * through the shrinker registered at Initialize when it's running low on memory). The pages also need to be
+     * unmapped, as Increment (or MapBlock) is going to map new ones when they are used again. We start with the end
+     * of the heap, and then go into the free blocks. We return how many pages were actually freed. */
+
+    if (!Initialized || Growing) return 0;
+
+    UIntPtr freed = ReturnTail(Pages);
+
+    return freed < Pages ? freed + TrimBlocks(Pages - freed) : freed;
+}
+
+UIntPtr Heap::ReturnTail(UIntPtr Pages) {
+    UIntPtr freed = 0;
+
+    for (; freed < Pages && CurrentAligned - PAGE_SIZE >= Current;) {
+        CurrentAligned -= PAGE_SIZE;
+        freed += UnmapPages(CurrentAligned, 1);
+    }
+
+    return freed;
+}
+
+UIntPtr Heap::TrimBlocks(UIntPtr Pages) {
+    /* Unmap the pages that are fully inside of the data area of the free blocks (except for the page with the header
+     * and the links), starting with the biggest blocks. The pages are only mapped again when the block gets used
+     * again (see MapBlock), which also means that blocks that never get used again stay like this. */
+
+    UIntPtr freed = 0, minfl, minsl;
+
+    GetIndex(PAGE_SIZE, minfl, minsl);
+
+    for (UIntPtr fl = HEAP_FL_COUNT; fl-- > minfl && freed < Pages;) {
+        if (!(FirstMap & BitOp::GetBit(fl))) continue;
+
+        for (UIntPtr sl = HEAP_SL_COUNT; sl-- > 0 && freed < Pages;) {
+            for (AllocBlock *blk = FreeLists[fl][sl]; blk != Null && freed < Pages; blk = blk->Next) {
+                UIntPtr start = (reinterpret_cast<UIntPtr>(blk) + sizeof(AllocBlock) + PAGE_MASK) & ~PAGE_MASK,
+                        end = reinterpret_cast<UIntPtr>(GetNext(blk)) & ~PAGE_MASK, count;
+
+                if (start >= end) continue;
+
+                count = (end - start) >> PAGE_SHIFT;
+                blk->Flags |= ALLOC_BLOCK_TRIMMED;
+                freed += UnmapPages(start, count < Pages - freed ? count : Pages - freed);
+            }
+        }
+    }
+
+    return freed;
+}
+
+UIntPtr Heap::UnmapPages(UIntPtr Start, UIntPtr Count) {
+    /* The pages can only go back to PhysMem after the TLB flush (else someone could get them while there are still
+     * stale TLB entries pointing to them), so we unmap and free them in batches. */
+
+    UIntPtr freed = 0, pages[HEAP_UNMAP_BATCH], count = 0;
+    TlbBatch batch;
+
+    for (UIntPtr i = 0; i < Count; i++, Start += PAGE_SIZE) {
         UIntPtr phys;
         UInt32 flags;
-        CurrentAligned -= PAGE_SIZE;
-        if (VirtMem::Query(CurrentAligned, phys, flags) == Status::Success) PhysMem::DereferenceSingle(phys);
+
+        if (VirtMem::Query(Start, phys, flags) == Status::Success &&
+            VirtMem::Unmap(Start, PAGE_SIZE, batch) == Status::Success) pages[count++] = phys;
+
+        if (count == HEAP_UNMAP_BATCH || (count && i + 1 == Count)) {
+            batch.Flush();
+
+            for (UIntPtr j = 0; j < count; j++) {
+                if (PhysMem::DereferenceSingle(pages[j]) == Status::Success) freed++;
+            }
+
+            count = 0;
+        }
     }
+
+    return freed;
 }
 
-Void Heap::AddFree(AllocBlock *Block) {
-    /* Add the entry to the free list (for faster free block searching). We don't have a non free block list, as even
-     * for getting the block size we don't need it (we would need it for dumping all the allocations though). It's
-     * probably a good idea to find the right place for this block (not just randomly add it to the end). */
+Status Heap::MapSlab(UIntPtr Start, UIntPtr Count) {
+    /* Same as what Increment does, but on failure we unmap everything that we did manage to map (the slab is either
+     * fully mapped or not there at all). The pages are zeroed, so that AllocSlab can skip zeroing the objects that
+     * were never used. */
+
+    UIntPtr i = 0, phys;
+    Status status = Status::Success;
+
+    Growing = True;
+
+    for (; i < Count; i++) {
+        if ((status = PhysMem::ReferenceSingle(0, phys, PAGE_SIZE, ALLOC_ZERO)) != Status::Success) break;
+        else if ((status = VirtMem::Map(Start + (i << PAGE_SHIFT), phys, PAGE_SIZE, MAP_RW)) != Status::Success) {
+            PhysMem::DereferenceSingle(phys);
+            break;
+        }
+
+        PhysMem::SetMovable(phys, Start + (i << PAGE_SHIFT));
+    }
 
-    if (Base == Null) {
-        Base = Tail = Block;
-        return;
+    Growing = False;
+
+    if (status != Status::Success) UnmapPages(Start, i);
+
+    return status;
+}
+
+SlabHeader *Heap::CreateSlab(UInt8 Class) {
+    /* Reuse the empty slab with the highest address if we have one (so that the ones at the bottom of the slab area
+     * have a chance of being released by ReturnSlabs), else, we need to grow the slab area downwards (as long as we
+     * don't collide with the block allocator). */
+
+    SlabHeader *slab = SlabEmpty;
+    UIntPtr size = SlabSizes[Class], clean = 0;
+
+    /* The memory of a reused slab is dirty, except for the pages that we had to map again (which are after the first
+     * page of the slab). */
+
+    if (slab != Null) {
+        if (slab->Trimmed && MapSlab(reinterpret_cast<UIntPtr>(slab) + PAGE_SIZE,
+                                     HEAP_SLAB_PAGES - 1) != Status::Success) return Null;
+
+        if ((SlabEmpty = slab->Next) != Null) SlabEmpty->Prev = Null;
+        else SlabEmptyTail = Null;
+
+        SlabEmptyPages -= slab->Trimmed ? 1 : HEAP_SLAB_PAGES;
+        clean = slab->Trimmed ? (PAGE_SIZE - HEAP_SLAB_START + size - 1) / size : HEAP_SLAB_SIZE;
+    } else if (SlabBottom - CurrentAligned < HEAP_SLAB_SIZE ||
+               MapSlab(SlabBottom - HEAP_SLAB_SIZE, HEAP_SLAB_PAGES) != Status::Success) return Null;
+    else slab = reinterpret_cast<SlabHeader*>(SlabBottom -= HEAP_SLAB_SIZE);
+
+    slab->Magic = ALLOC_SLAB_MAGIC;
+    slab->Next = slab->Prev = Null;
+    slab->Free = Null;
+    slab->Used = slab->Bump = 0;
+    slab->Capacity = (HEAP_SLAB_SIZE - HEAP_SLAB_START) / size;
+    slab->Clean = clean < slab->Capacity ? clean : slab->Capacity;
+    slab->Class = Class;
+    slab->Trimmed = False;
+
+    SetMemory(slab->Allocated, 0, sizeof(slab->Allocated));
+
+    return SlabPartial[Class] = slab;
+}
+
+Void *Heap::AllocSlab(UInt8 Class, Boolean Zero) {
+    /* The partial list only has slabs with at least one free object, so this is O(1) (unless we need to create a new
+     * slab). The objects that were never used don't go into the free list, we just bump the Bump counter, so that
+     * creating a slab doesn't need to touch all of its objects (and if they are past the Clean index, they are still
+     * zeroed). */
+
+    SlabHeader *slab = SlabPartial[Class];
+    UIntPtr idx;
+    Void *ret;
+
+    if (slab == Null && (slab = CreateSlab(Class)) == Null) return Null;
+
+    if (slab->Free != Null) {
+        ret = slab->Free;
+        slab->Free = *static_cast<Void**>(ret);
+        idx = static_cast<UInt32>(reinterpret_cast<UIntPtr>(ret) - reinterpret_cast<UIntPtr>(slab) - HEAP_SLAB_START) /
+              SlabSizes[Class];
+    } else {
+        if (slab->Bump >= slab->Clean) Zero = False;
+        idx = slab->Bump++;
+        ret = reinterpret_cast<Void*>(reinterpret_cast<UIntPtr>(slab) + HEAP_SLAB_START + idx * SlabSizes[Class]);
     }
 
-    AllocBlock *cur = Base;
+    slab->Allocated[idx / HEAP_SLAB_BITMAP_BITS] |= static_cast<UIntPtr>(1) << (idx % HEAP_SLAB_BITMAP_BITS);
 
-    while (cur != Null && cur->Start > Block->Start) cur = cur->Next;
+    if (++slab->Used == slab->Capacity) RemoveSlab(SlabPartial[Class], slab);
+    if (Zero) SetMemory(ret, 0, SlabSizes[Class]);
+
+    return ret;
+}
+
+Void Heap::FreeSlab(SlabHeader *Slab, Void *Address) {
+    /* The object needs to be the start of some object that was handed out (and is still allocated), else, this is a
+     * double free (or a free of something that we never returned), and the free list would end up with a cycle. */
+
+    UIntPtr off = reinterpret_cast<UIntPtr>(Address) - reinterpret_cast<UIntPtr>(Slab) - HEAP_SLAB_START,
+            idx = static_cast<UInt32>(off) / SlabSizes[Slab->Class],
+            bit = static_cast<UIntPtr>(1) << (idx % HEAP_SLAB_BITMAP_BITS);
+
+    ASSERT(Slab->Used && off < HEAP_SLAB_SIZE && idx < Slab->Bump && idx * SlabSizes[Slab->Class] == off);
+    ASSERT(Slab->Allocated[idx / HEAP_SLAB_BITMAP_BITS] & bit);
+
+    Slab->Allocated[idx / HEAP_SLAB_BITMAP_BITS] &= ~bit;
+    *static_cast<Void**>(Address) = Slab->Free;
+    Slab->Free = Address;
+
+    /* Full slabs are not on any list, so put it back on the partial list; and if it just became empty, move it to the
+     * empty list (unless it's the only partial slab of its class, we don't want to keep moving the same slab back and
+     * forth when something allocates and frees a single object in a loop). */
+
+    if (Slab->Used-- == Slab->Capacity) {
+        if ((Slab->Next = SlabPartial[Slab->Class]) != Null) Slab->Next->Prev = Slab;
+        SlabPartial[Slab->Class] = Slab;
+    }
+
+    if (Slab->Used || (SlabPartial[Slab->Class] == Slab && Slab->Next == Null)) return;
+
+    RemoveSlab(SlabPartial[Slab->Class], Slab);
+    AddEmptySlab(Slab);
+}
+
+Void Heap::AddEmptySlab(SlabHeader *Slab) {
+    /* The empty list is sorted by address (highest first), so that CreateSlab takes from the top, and ReturnSlabs
+     * looks at the bottom. */
+
+    SlabHeader *cur = SlabEmpty;
+
+    Slab->Free = Null;
+    Slab->Bump = 0;
+    SlabEmptyPages += HEAP_SLAB_PAGES;
+
+    while (cur != Null && cur > Slab) cur = cur->Next;
 
     if (cur != Null) {
-        Block->Next = cur;
-        if (cur->Prev != Null) cur->Prev->Next = Block;
-        else Base = Block;
+        if ((Slab->Prev = cur->Prev) != Null) Slab->Prev->Next = Slab;
+        else SlabEmpty = Slab;
+        Slab->Next = cur;
+        cur->Prev = Slab;
     } else {
-        Tail->Next = Block;
-        Block->Prev = Tail;
-        Tail = Block;
+        if ((Slab->Prev = SlabEmptyTail) != Null) SlabEmptyTail->Next = Slab;
+        else SlabEmpty = Slab;
+        SlabEmptyTail = Slab;
     }
 }
 
-Void Heap::RemoveFree(AllocBlock *Block) {
-    /* And here we do the inverse, remove the entry from the free list (nothing to do afterwards, as there is no other
-     * list). */
+Void Heap::RemoveSlab(SlabHeader *&Head, SlabHeader *Slab) {
+    if (Slab->Prev != Null) Slab->Prev->Next = Slab->Next;
+    else Head = Slab->Next;
 
-    if (Block->Next != Null) Block->Next->Prev = Block->Prev;
+    if (Slab->Next != Null) Slab->Next->Prev = Slab->Prev;
+
+    Slab->Next = Slab->Prev = Null;
+}
+
+UIntPtr Heap::CountSlabs() {
+    /* Besides the empty list, the partial lists may also have one empty slab each (see FreeSlab). */
+
+    UIntPtr count = SlabEmptyPages;
+
+    if (!Initialized || Growing) return 0;
+
+    for (SlabHeader *slab : SlabPartial) {
+        if (slab != Null && !slab->Used) count += HEAP_SLAB_PAGES;
+    }
+
+    return count;
+}
+
+UIntPtr Heap::ReturnSlabs(UIntPtr Pages) {
+    /* FreeSlab leaves an empty slab on the partial list when it's the only one there, but we're running low on memory,
+     * so move those to the empty list as well. After that, the empty slabs at the bottom of the slab area can be
+     * released completely (and the slab area shrinks back). */
+
+    UIntPtr freed = 0;
+
+    if (!Initialized || Growing) return 0;
+
+    for (SlabHeader *&slab : SlabPartial) {
+        if (slab == Null || slab->Used) continue;
+        SlabHeader *empty = slab;
+        RemoveSlab(slab, empty);
+        AddEmptySlab(empty);
+    }
+
+    while (freed < Pages && SlabEmptyTail != Null && reinterpret_cast<UIntPtr>(SlabEmptyTail) == SlabBottom) {
+        SlabHeader *slab = SlabEmptyTail;
+        UIntPtr count = slab->Trimmed ? 1 : HEAP_SLAB_PAGES;
+
+        if ((SlabEmptyTail = slab->Prev) != Null) SlabEmptyTail->Next = Null;
+        else SlabEmpty = Null;
+
+        SlabEmptyPages -= count;
+        SlabBottom += HEAP_SLAB_SIZE;
+        freed += UnmapPages(reinterpret_cast<UIntPtr>(slab), count);
+    }
+
+    /* For the other ones, the first page needs to stay (as it has the list links), but everything else can go. */
+
+    for (SlabHeader *cur = SlabEmptyTail; freed < Pages && cur != Null; cur = cur->Prev) {
+        if (cur->Trimmed) continue;
+
+        cur->Trimmed = True;
+        SlabEmptyPages -= HEAP_SLAB_PAGES - 1;
+        freed += UnmapPages(reinterpret_cast<UIntPtr>(cur) + PAGE_SIZE, HEAP_SLAB_PAGES - 1);
+    }
+
+    return freed;
+}
+
+Boolean Heap::AddLargeRange(UIntPtr Start, UIntPtr End) {
+    /* Give a range back to the large area, merging it with the free ranges around it (or, if it's at the end of the
+     * used part of the area, just moving LargeCurrent back). If the array is full and we can't merge, the range is
+     * lost (but that's only virtual space, the pages were already freed). */
+
+    UIntPtr i = 0;
+
+    if (Start >= End) return True;
+
+    while (i < LargeFreeCount && LargeFree[i].Start < Start) i++;
+
+    Boolean prev = i && LargeFree[i - 1].End == Start, next = i < LargeFreeCount && LargeFree[i].Start == End;
+
+    if (End == LargeCurrent) {
+        if (prev) Start = LargeFree[--LargeFreeCount].Start;
+        LargeCurrent = Start;
+    } else if (prev && next) {
+        LargeFree[i - 1].End = LargeFree[i].End;
+        MoveMemory(&LargeFree[i], &LargeFree[i + 1], (--LargeFreeCount - i) * sizeof(LargeRange));
+    } else if (prev) LargeFree[i - 1].End = End;
+    else if (next) LargeFree[i].Start = Start;
+    else if (LargeFreeCount >= HEAP_LARGE_RANGES) return False;
     else {
-        Tail = Block->Prev;
-        if (Tail != Null) Tail->Next = Null;
-        else Base = Null;
+        MoveMemory(&LargeFree[i + 1], &LargeFree[i], (LargeFreeCount++ - i) * sizeof(LargeRange));
+        LargeFree[i] = { Start, End };
     }
 
-    if (Block->Prev != Null) Block->Prev->Next = Block->Next;
-    else if (Block->Next != Null) {
-        Block->Next->Prev = Null;
-        Base = Block->Next;
+    return True;
+}
+
+Boolean Heap::CarveLargeRange(UIntPtr Index, UIntPtr Start, UIntPtr End) {
+    /* Remove the [Start, End) part of a free range, which may leave up to two smaller ranges (and if that's the case,
+     * we need one more entry on the array). */
+
+    LargeRange &rng = LargeFree[Index];
+
+    if (Start > rng.Start && End < rng.End) {
+        if (LargeFreeCount >= HEAP_LARGE_RANGES) return False;
+        MoveMemory(&LargeFree[Index + 2], &LargeFree[Index + 1], (LargeFreeCount++ - Index - 1) * sizeof(LargeRange));
+        LargeFree[Index + 1] = { End, rng.End };
+        rng.End = Start;
+    } else if (Start > rng.Start) rng.End = Start;
+    else if (End < rng.End) rng.Start = End;
+    else MoveMemory(&LargeFree[Index], &LargeFree[Index + 1], (--LargeFreeCount - Index) * sizeof(LargeRange));
+
+    return True;
+}
+
+UIntPtr Heap::FindLarge(UIntPtr Size, UIntPtr Align) {
+    /* First fit on the free ranges (there shouldn't be many of them), and if nothing fits, take the space from the end
+     * of the used part of the large area (the space that we skip to align the start becomes a free range). */
+
+    for (UIntPtr i = 0; i < LargeFreeCount; i++) {
+        UIntPtr start = (LargeFree[i].Start + Align - 1) & -Align;
+        if (start < LargeFree[i].End && LargeFree[i].End - start >= Size && CarveLargeRange(i, start, start + Size)) {
+            return start;
+        }
     }
 
-    Block->Next = Block->Prev = Null;
+    UIntPtr cur = LargeCurrent, start = (cur + Align - 1) & -Align;
+
+    if (start < cur || start > End || End - start < Size) return 0;
+
+    LargeCurrent = start + Size;
+    AddLargeRange(cur, start);
+
+    return start;
 }
 
-Void Heap::SplitBlock(AllocBlock *Block, UIntPtr Size) {
-    /* We probably could skip the Null pointer checks, as the only ones that are going to call this (and the other
-     * private functions) is ourselves, but let's do it anyways. We also need to check if the block is big enough to be
-     * split, it needs at least the size of the new block we want to create + the size of the alloc header. */
+Boolean Heap::TakeLarge(UIntPtr Start, UIntPtr End) {
+    /* Reserve exactly the [Start, End) range (used for growing allocations in place), either from the end of the used
+     * part of the large area, or from the free range that starts at Start. */
+
+    if (Start == LargeCurrent) return End <= Heap::End ? (LargeCurrent = End, True) : False;
+
+    for (UIntPtr i = 0; i < LargeFreeCount && LargeFree[i].Start <= Start; i++) {
+        if (LargeFree[i].Start == Start) return LargeFree[i].End >= End && CarveLargeRange(i, Start, End);
+    }
 
-    if (Block == Null || !Size || Block->Size <= Size + sizeof(AllocBlock)) return;
+    return False;
+}
 
-    /* Let's split the block so the current block have exactly the same that the caller asked for, and the new block is
-     * the remainder (which will be set as free). */
+Status Heap::MapLarge(UIntPtr Start, UIntPtr End, Boolean Zero) {
+    /* Use huge pages wherever the range covers a whole (aligned) huge page, and normal pages for the rest (also if we
+     * can't get/map a huge page, in which case we don't try again for this range). On failure, everything that we did
+     * map is unmapped again. Unlike the block heap, we only ask for zeroed pages if the caller wants zeroed memory. */
 
-    auto nblk = reinterpret_cast<AllocBlock*>(Block->Start + Size);
+    UIntPtr cur = Start, phys;
+    Boolean huge = True;
+    Status status = Status::Success;
 
-    SetMemory(nblk, 0, sizeof(AllocBlock));
+    while (cur < End) {
+        if (huge && !(cur & HUGE_PAGE_MASK) && End - cur >= HUGE_PAGE_SIZE) {
+            if (PhysMem::AllocHuge(phys) == Status::Success) {
+                if (VirtMem::Map(cur, phys, HUGE_PAGE_SIZE, MAP_RW | MAP_HUGE) == Status::Success) {
+                    if (Zero) SetMemory(reinterpret_cast<Void*>(cur), 0, HUGE_PAGE_SIZE);
+                    cur += HUGE_PAGE_SIZE;
+                    continue;
+                }
 
-    nblk->Magic = ALLOC_BLOCK_MAGIC;
-    nblk->Start = Block->Start + Size + sizeof(AllocBlock);
-    nblk->Size = Block->Size - (Size + sizeof(AllocBlock));
-    Block->Size = Size;
+                PhysMem::FreeHuge(phys);
+            }
+
+            huge = False;
+        }
+
+        if ((status = PhysMem::ReferenceSingle(0, phys, PAGE_SIZE, Zero ? ALLOC_ZERO : 0)) != Status::Success) break;
+        else if ((status = VirtMem::Map(cur, phys, PAGE_SIZE, MAP_RW)) != Status::Success) {
+            PhysMem::DereferenceSingle(phys);
+            break;
+        }
+
+        PhysMem::SetMovable(phys, cur);
+        cur += PAGE_SIZE;
+    }
+
+    if (status != Status::Success) UnmapLarge(Start, cur);
+
+    return status;
+}
+
+Void Heap::UnmapLarge(UIntPtr Start, UIntPtr End) {
+    /* The huge pages never had a reference count (they came from AllocHuge), so they go back using FreeHuge, the
+     * normal pages are handled by UnmapPages (one call for each run of normal pages between the huge pages, so that
+     * the whole run shares the same TLB flushes). */
 
-    AddFree(nblk);
+    UIntPtr cur = Start, run = Start, phys;
+
+    while (cur < End) {
+        UInt32 flags;
+
+        if (VirtMem::Query(cur, phys, flags) != Status::Success || !(flags & MAP_HUGE)) {
+            cur += PAGE_SIZE;
+            continue;
+        } else if (run < cur) {
+            UnmapPages(run, (cur - run) >> PAGE_SHIFT);
+        }
+
+        VirtMem::Unmap(cur, HUGE_PAGE_SIZE, True);
+        PhysMem::FreeHuge(phys);
+        run = cur += HUGE_PAGE_SIZE;
+    }
+
+    if (run < End) UnmapPages(run, (End - run) >> PAGE_SHIFT);
+}
+
+Void *Heap::AllocLarge(UIntPtr Size, UIntPtr Align, Boolean Zero) {
+    /* The data starts at the first aligned address after the header (and the range starts aligned to at least Align,
+     * so that's always the same offset). Round the size up to whole pages, but when the alignment is big enough that
+     * whole pages would be left before the header, we give those back as a free range (and don't map them).
+     * Allocations that are at least a huge page in size also start at a huge page boundary, so that MapLarge can use
+     * huge pages for (most of) them. */
+
+    UIntPtr lead = (sizeof(LargeHeader) + Align - 1) & -Align, skip = (lead - sizeof(LargeHeader)) & ~PAGE_MASK;
+
+    if (Size > UINTPTR_MAX - lead - PAGE_MASK) return Null;
+
+    UIntPtr size = (Size + lead + PAGE_MASK) & ~PAGE_MASK,
+            start = FindLarge(size, !skip && size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE :
+                                    (Align > PAGE_SIZE ? Align : PAGE_SIZE));
+
+    if (!start) return Null;
+    else if (MapLarge(start + skip, start + size, Zero) != Status::Success) {
+        return AddLargeRange(start, start + size), Null;
+    } else if (skip) AddLargeRange(start, start + skip);
+
+    auto hdr = reinterpret_cast<LargeHeader*>(start + lead) - 1;
+
+    hdr->Pages = (size - skip) >> PAGE_SHIFT;
+    hdr->Magic = ALLOC_LARGE_MAGIC;
+    LargePages += hdr->Pages;
+
+    return reinterpret_cast<Void*>(start + lead);
 }
 
-AllocBlock *Heap::FuseBlock(AllocBlock *Block) {
-    /* We can only fuse blocks that are just after ourselves, to fuse blocks that are in the ->Prev field, the caller
-     * should call the FuseBlock function on the ->Prev field, instead of the current block. */
+Void Heap::FreeLarge(LargeHeader *Header) {
+    /* Everything goes back to PhysMem right away (we don't keep anything cached here). */
+
+    UIntPtr start = reinterpret_cast<UIntPtr>(Header) & ~PAGE_MASK, end = start + (Header->Pages << PAGE_SHIFT);
+
+    LargePages -= Header->Pages;
+    Header->Magic = 0;
+
+    UnmapLarge(start, end);
+    AddLargeRange(start, end);
+}
 
-    if (Block != Null && Block->Next != Null && reinterpret_cast<UIntPtr>(Block->Next) == Block->Start + Block->Size) {
-        Block->Size += sizeof(AllocBlock) + Block->Next->Size;
-        Block->Next = Block->Next->Next;
+Boolean Heap::ResizeLarge(LargeHeader *Header, UIntPtr Size) {
+    /* Growing needs the range just after the allocation to be free, shrinking gives the pages at the end back (but we
+     * can't split a huge page, so if the new end is in the middle of one, we keep the whole huge page). */
 
-        if (Block->Next != Null) Block->Next->Prev = Block;
-        else {
-            Tail->Prev->Next = Block;
-            Tail = Block;
+    auto addr = reinterpret_cast<UIntPtr>(Header + 1);
+
+    if (Size > UINTPTR_MAX - addr - PAGE_MASK) return False;
+
+    UIntPtr start = reinterpret_cast<UIntPtr>(Header) & ~PAGE_MASK, end = start + (Header->Pages << PAGE_SHIFT),
+            nend = (addr + Size + PAGE_MASK) & ~PAGE_MASK, phys;
+    UInt32 flags;
+
+    if (nend > end) {
+        if (!TakeLarge(end, nend)) return False;
+        else if (MapLarge(end, nend, False) != Status::Success) return AddLargeRange(end, nend), False;
+    } else if (nend < end) {
+        if (VirtMem::Query(nend, phys, flags) == Status::Success && (flags & MAP_HUGE)) {
+            nend = (nend + HUGE_PAGE_MASK) & ~HUGE_PAGE_MASK;
         }
 
-        return Block;
+        UnmapLarge(nend, end);
+        AddLargeRange(nend, end);
     }
 
-    return Null;
+    LargePages = LargePages - Header->Pages + ((nend - start) >> PAGE_SHIFT);
+    Header->Pages = (nend - start) >> PAGE_SHIFT;
+
+    return True;
+}
+
+Void Heap::GetIndex(UIntPtr Size, UIntPtr &First, UIntPtr &Second) {
+    /* The first level is the highest bit of the size, and the second level splits each first level into HEAP_SL_COUNT
+     * linear steps. Everything below HEAP_SMALL_SIZE goes into the first level 0 (split in 16-byte steps), as using
+     * the highest bit there would give us lists smaller than the minimum block size. */
+
+    if (Size < HEAP_SMALL_SIZE) {
+        First = 0;
+        Second = Size >> 4;
+    } else {
+        UIntPtr log = BitOp::ScanReverse(Size);
+        First = log - (HEAP_FL_SHIFT - 1);
+        Second = (Size >> (log - HEAP_SL_SHIFT)) ^ HEAP_SL_COUNT;
+    }
+}
+
+Void Heap::AddFree(AllocBlock *Block) {
+    /* Add the block to the start of the free list of its size class (and mark the list as non-empty on both bitmaps),
+     * the links live in the (unused) data area of the block. */
+
+    UIntPtr fl, sl;
+
+    GetIndex(Block->Size, fl, sl);
+
+    Block->Flags |= ALLOC_BLOCK_FREE;
+    Block->Prev = Null;
+
+    if ((Block->Next = FreeLists[fl][sl]) != Null) Block->Next->Prev = Block;
+
+    FreeLists[fl][sl] = Block;
+    FirstMap |= BitOp::GetBit(fl);
+    SecondMap[fl] |= BitOp::GetBit(sl);
+}
+
+Void Heap::RemoveFree(AllocBlock *Block) {
+    /* And here we do the inverse, remove the entry from its free list (clearing the bitmap bits if the list is now
+     * empty). */
+
+    UIntPtr fl, sl;
+
+    GetIndex(Block->Size, fl, sl);
+
+    if (Block->Next != Null) Block->Next->Prev = Block->Prev;
+
+    if (Block->Prev != Null) Block->Prev->Next = Block->Next;
+    else if ((FreeLists[fl][sl] = Block->Next) == Null && !(SecondMap[fl] &= ~BitOp::GetBit(sl))) {
+        FirstMap &= ~BitOp::GetBit(fl);
+    }
+
+    Block->Flags &= ~ALLOC_BLOCK_FREE;
+}
+
+AllocBlock *Heap::SplitBlock(AllocBlock *Block, UIntPtr Size) {
+    /* The block needs to be big enough to be split, it needs at least the size of the new block we want to create +
+     * the size of the alloc header + the minimum block size (16 bytes). The block shouldn't be on the free lists, and
+     * we return the remainder (the caller decides what to do with it, it's not on the free lists yet). */
+
+    if (Block == Null || !Size || Block->Size < Size + ALLOC_BLOCK_HEADER + 16) return Null;
+
+    auto nblk = reinterpret_cast<AllocBlock*>(reinterpret_cast<UIntPtr>(Block) + ALLOC_BLOCK_HEADER + Size);
+
+    nblk->Magic = ALLOC_BLOCK_MAGIC;
+    nblk->PrevPhys = Block;
+    nblk->Size = Block->Size - (Size + ALLOC_BLOCK_HEADER);
+    nblk->Flags = Block->Flags & ALLOC_BLOCK_TRIMMED;
+    Block->Size = Size;
+
+    if (Block == Last) Last = nblk;
+    else GetNext(nblk)->PrevPhys = nblk;
+
+    return nblk;
+}
+
+Void Heap::FuseBlock(AllocBlock *Block) {
+    /* We can only fuse the block that is just after ourselves (the caller should have removed it from the free lists
+     * already), to fuse with the previous block, the caller should call us on ->PrevPhys instead. The magic value of
+     * the absorbed header is cleared, so that a stale pointer to it fails the checks on Deallocate. */
+
+    AllocBlock *next = GetNext(Block);
+
+    Block->Size += ALLOC_BLOCK_HEADER + next->Size;
+    Block->Flags |= next->Flags & ALLOC_BLOCK_TRIMMED;
+    next->Magic = 0;
+
+    if (next == Last) Last = Block;
+    else GetNext(Block)->PrevPhys = Block;
 }
 
 AllocBlock *Heap::FindBlock(UIntPtr Size) {
-    /* The block list always ends (or starts, if there are no blocks yet) on a Null pointer, so we can always just keep
-     * on following the ->Next chain until we find a Null pointer. */
+    /* Round the size up to the next second level step, so that any block on the list that we find is big enough
+     * (good fit instead of best fit, but in O(1)); after that, it's just a matter of finding the first non-empty list
+     * at or above that one, first on the same first level, then on the bigger ones. */
 
-    if (!Size) return Null;
+    UIntPtr fl, sl, map, size = Size;
 
-    AllocBlock *cur = Base, *best = Null;
+    if (Size >= HEAP_SMALL_SIZE) size += BitOp::GetBit(BitOp::ScanReverse(Size) - HEAP_SL_SHIFT) - 1;
 
-    while (cur != Null) {
-        if (cur->Size >= Size && (best == Null || cur->Size < best->Size)) best = cur;
-        cur = cur->Next;
+    GetIndex(size, fl, sl);
+
+    if (size < Size || fl >= HEAP_FL_COUNT) return Null;
+    else if (!(map = SecondMap[fl] & (UIntPtr(-1) << sl))) {
+        if (fl + 1 >= HEAP_FL_COUNT || !(map = FirstMap & (UIntPtr(-1) << (fl + 1)))) return Null;
+        map = SecondMap[fl = BitOp::ScanForward(map)];
     }
 
-    return best;
+    AllocBlock *blk = FreeLists[fl][BitOp::ScanForward(map)];
+
+    return RemoveFree(blk), blk;
 }
 
 AllocBlock *Heap::CreateBlock(UIntPtr Size) {
-    /* The "Last" pointer is not required (for example, this may be the first time we're allocating memory, and this may
-     * be the first allocation), but we do need to check if the Size is valid. */
+    /* Here on the kernel, we can just increment the heap pointer (actually we also need to alloc and map, but the
+     * Increment function takes care of that). If the last block is free, we can just grow it instead (FindBlock may
+     * also have skipped it, if it was on the same list as the size we want). */
 
     if (!Size) return Null;
 
-    /* Here on the kernel, we can just increment the heap pointer (actually we also need to alloc and map, but the
-     * Increment function takes care of that), a bit different from heap function of other OSes, we need to first get
-     * the current location of the heap, and call the Increment function (that is going to return if the increment is
-     * valid, and if it succeeded). */
+    AllocBlock *blk = Last;
 
-    auto blk = reinterpret_cast<AllocBlock*>(Current);
+    if (blk != Null && (blk->Flags & ALLOC_BLOCK_FREE)) {
+        RemoveFree(blk);
 
-    if (Increment(Size + sizeof(AllocBlock)) != Status::Success) return Null;
+        if (blk->Size < Size) {
+            if (Increment(Size - blk->Size) != Status::Success) return AddFree(blk), Null;
+            blk->Size = Size;
+        }
+
+        return blk;
+    }
 
-    SetMemory(blk, 0, sizeof(AllocBlock));
+    blk = reinterpret_cast<AllocBlock*>(Current);
+
+    if (Increment(Size + ALLOC_BLOCK_HEADER) != Status::Success) return Null;
 
     blk->Magic = ALLOC_BLOCK_MAGIC;
-    blk->Start = reinterpret_cast<UIntPtr>(blk) + sizeof(AllocBlock);
+    blk->PrevPhys = Last;
     blk->Size = Size;
+    blk->Flags = 0;
 
-    return blk;
+    return Last = blk;
 }
 
-Void *Heap::Allocate(UIntPtr Size) {
+Status Heap::MapBlock(AllocBlock *Block, UIntPtr Size) {
+    /* Map back the pages that TrimBlocks unmapped, but only for the part of the block that we're going to use (the
+     * first Size bytes of the data, and the header of the remainder if the block is going to be split). */
+
+    UIntPtr start = reinterpret_cast<UIntPtr>(Block) + ALLOC_BLOCK_HEADER, end = start + Size, phys;
+    UInt32 flags;
+    Status status;
+
+    if (Block->Size >= Size + ALLOC_BLOCK_HEADER + 16) end += sizeof(AllocBlock);
+
+    for (start &= ~PAGE_MASK; start < end; start += PAGE_SIZE) {
+        if (VirtMem::Query(start, phys, flags) == Status::Success) continue;
+        else if ((status = PhysMem::ReferenceSingle(0, phys, PAGE_SIZE, ALLOC_ZERO)) != Status::Success) return status;
+        else if ((status = VirtMem::Map(start, phys, PAGE_SIZE, MAP_RW)) != Status::Success) {
+            PhysMem::DereferenceSingle(phys);
+            return status;
+        }
+
+        PhysMem::SetMovable(phys, start);
+    }
+
+    return Status::Success;
+}
+
+Void *Heap::AllocInt(UIntPtr Size, Boolean Zero) {
+    /* ::Allocate already guarantees 16-byte alignment, so this is just the aligned version with the minimum
+     * alignment. */
+
+    return AllocInt(Size, 16, Zero);
+}
+
+Void *Heap::AllocInt(UIntPtr Size, UIntPtr Align, Boolean Zero) {
     /* With all the function that we wrote, now is just a question of checking if we need to create a new block, or
-     * use/split an existing one. */
+     * use/split an existing one. The Align value needs to be a power of 2, and anything lesser than 16 is the same as
+     * 16 (as everything is always 16-byte aligned). */
+
+    if (!Align || (Align & (Align - 1)) || Size > UINTPTR_MAX - 15) return Null;
 
     Size = ((Size > 0 ? Size : 1) + 15) & -16;
+    Align = Align > 16 ? Align : 16;
 
-    AllocBlock *blk = FindBlock(Size);
+    /* Small allocations go to the slab allocator (if it fails, the block allocator might still have some space left
+     * somewhere). The objects start at HEAP_SLAB_START, which is aligned to HEAP_SLAB_ALIGN, so for alignments up to
+     * that, we just need to use the first class whose size is a multiple of the alignment. */
 
-    if (blk != Null) {
-        /* Let's not waste space, and split the block that we found in case it is too big. */
+    if (Size <= HEAP_SLAB_MAX && Align <= HEAP_SLAB_ALIGN) {
+        UIntPtr cls = SlabIndex[Size >> 4];
 
-        if (blk->Size > Size + sizeof(AllocBlock)) SplitBlock(blk, Size);
-        RemoveFree(blk);
-    } else {
-        blk = CreateBlock(Size);
+        while (cls < HEAP_SLAB_CLASSES && (SlabSizes[cls] & (Align - 1))) cls++;
+
+        Void *ret = cls < HEAP_SLAB_CLASSES ? AllocSlab(cls, Zero) : Null;
+        if (ret != Null) return ret;
     }
 
-    /* If everything went well, we can zero the allocated memory (just to be safe) and return, else, we should return a
-     * null pointer.
-     * The ASSERT() is temp, as it's only here to make sure our allocator is properly working/always returning 16-byte
-     * aligned buffers. */
+    /* Same for the large allocations, those are mapped directly (and the block allocator is only used if we run out
+     * of space on the large area). */
 
-    if (blk != Null) {
-        ASSERT(!(blk->Start & 0x0F));
-        auto ret = reinterpret_cast<Void*>(blk->Start);
-        return SetMemory(ret, 0, Size), ret;
+    if (Size >= HEAP_LARGE_MIN) {
+        Void *ret = AllocLarge(Size, Align, Zero);
+        if (ret != Null) return ret;
     }
 
-    return Null;
-}
+    /* For aligned allocations, we need a block big enough that we can move the start of the data forward into the
+     * alignment, while leaving enough space before it for a (minimum size) free block. */
 
-Void *Heap::Allocate(UIntPtr Size, UIntPtr Align) {
-    /* Just as in the other allocate function, the size needs to be valid and aligned, but now we also need to check if
-     * the Align value is valid (it needs to be a power of 2). Also, ::Allocate already guarantees 16-byte alignment, so
-     * for Align values lesser or equal to that, we don't need anything special. */
+    UIntPtr need = Align > 16 ? Size + Align + ALLOC_BLOCK_HEADER + 16 : Size, clean = UINTPTR_MAX;
+    AllocBlock *blk, *rem;
+
+    if (need < Size) return Null;
+    else if ((blk = FindBlock(need)) == Null) {
+        clean = CurrentAligned;
+        if ((blk = CreateBlock(need)) == Null) return Null;
+    }
+
+    UIntPtr data = reinterpret_cast<UIntPtr>(blk) + ALLOC_BLOCK_HEADER, start = (data + Align - 1) & -Align;
+
+    if (start != data && start - data < ALLOC_BLOCK_HEADER + 16) start += Align;
+
+    /* Let's not waste space, and split the block that we got in case it is too big (the next block is never free, so
+     * the remainder can go straight into the free lists, and it keeps the trimmed flag, as we only map back what we're
+     * going to use). The leading slack of aligned allocations is split the same way (the previous block is never free
+     * either). After that, we can zero the allocated memory (if the caller asked for it) and return. Everything above
+     * the old CurrentAligned was just mapped by Increment (using zeroed pages), so we only need to clean what is below
+     * it.
+     * The ASSERT() is temp, as it's only here to make sure our allocator is properly working/always returning properly
+     * aligned buffers. */
 
-    if (!Size || !Align || (Align & (Align - 1))) return Null;
-    else if (Align <= 16) return Allocate(Size);
+    if ((blk->Flags & ALLOC_BLOCK_TRIMMED) && MapBlock(blk, start - data + Size) != Status::Success) {
+        return FreeBlock(blk), Null;
+    } else if (start != data) {
+        rem = blk;
+        blk = SplitBlock(rem, start - data - ALLOC_BLOCK_HEADER);
+        AddFree(rem);
+    }
 
-    /* Let's over-alloc the space we need, so we can save that this is an aligned allocation, and the address of the
-     * block header. */
+    if ((rem = SplitBlock(blk, Size)) != Null) AddFree(rem);
 
-    UIntPtr tsz = Size + 2 * sizeof(UIntPtr) + (Align - 1);
-    Void *p0 = Allocate(tsz);
+    blk->Flags &= ~ALLOC_BLOCK_TRIMMED;
 
-    if (p0 == Null) return Null;
+    auto ret = reinterpret_cast<Void*>(start);
 
-    /* Now, we just need to get the actual aligned start (the part that we're going to return). We can access it like it
-     * was a pointer, to save what we need. */
+    ASSERT(!(start & (Align - 1)) && start == reinterpret_cast<UIntPtr>(blk) + ALLOC_BLOCK_HEADER);
 
-    auto p0i = reinterpret_cast<UIntPtr>(p0);
-    auto p1 = reinterpret_cast<UIntPtr*>((p0i + tsz) & -Align);
+    if (Zero && clean > start) SetMemory(ret, 0, clean - start < Size ? clean - start : Size);
 
-    return p1[-1] = ALLOC_BLOCK_MAGIC, p1[-2] = p0i - sizeof(AllocBlock), p1;
+    return ret;
 }
 
+/* Allocate always returns zeroed memory, while AllocateUninit is for the callers that are going to initialize the
+ * memory themselves anyways (like the containers, or ::new). All of them go through the heap profiler sampling check
+ * (see profile.cxx). */
+
+Void *Heap::Allocate(UIntPtr Size) { return Profile(AllocInt(Size, True), Size); }
+Void *Heap::Allocate(UIntPtr Size, UIntPtr Align) { return Profile(AllocInt(Size, Align, True), Size); }
+Void *Heap::AllocateUninit(UIntPtr Size) { return Profile(AllocInt(Size, False), Size); }
+Void *Heap::AllocateUninit(UIntPtr Size, UIntPtr Align) { return Profile(AllocInt(Size, Align, False), Size); }
+
 Void Heap::Deallocate(Void *Address) {
-    /* We need to check if the specified address is valid, and is inside of the kernel heap (from the start until the
-     * current highest allocated address), after that, we need to check if this is an aligned allocation, if it is, we
-     * need to convert the address into an UIntPtr pointer, and access ptr[-2] to get the header location, else, we just
-     * subtract the size of the header from the address. */
+    /* Anything inside of the slab area belongs to the slab allocator, anything inside of the used part of the large
+     * area is a large allocation, and everything else is a block. Aligned allocations are allocated natively by all
+     * of them, so the address is always the start of the object/data. */
 
-    AllocBlock *blk, *fblk;
     auto addr = reinterpret_cast<UIntPtr>(Address);
 
-    ASSERT(Address != Null && addr >= Start + sizeof(AllocBlock) && Start <= Current);
+    ASSERT(Address != Null);
+
+    if (ProfileLive) Unsample(Address);
+
+    if (addr >= SlabBottom && addr < SlabTop) {
+        auto slab = reinterpret_cast<SlabHeader*>(addr & ~HEAP_SLAB_MASK);
+        UIntPtr first = reinterpret_cast<UIntPtr>(slab) + HEAP_SLAB_START;
+
+        ASSERT(slab->Magic == ALLOC_SLAB_MAGIC && !slab->Trimmed && addr >= first);
+
+        return FreeSlab(slab, Address);
+    } else if (addr >= LargeStart && addr < LargeCurrent) {
+        auto hdr = reinterpret_cast<LargeHeader*>(Address) - 1;
+
+        ASSERT(hdr->Magic == ALLOC_LARGE_MAGIC);
+
+        return FreeLarge(hdr);
+    }
 
-    if (addr - 2 * sizeof(UIntPtr) >= Start + sizeof(AllocBlock) &&
-        (reinterpret_cast<UIntPtr*>(Address))[-1] == ALLOC_BLOCK_MAGIC) {
-        blk = reinterpret_cast<AllocBlock *>((reinterpret_cast<UIntPtr *>(Address))[-2]);
-    } else blk = reinterpret_cast<AllocBlock*>(addr - sizeof(AllocBlock));
+    /* Otherwise, we need to check if the specified address is valid, and is inside of the kernel heap (from the start
+     * until the current highest allocated address), after that, we just subtract the size of the header from the
+     * address. */
+
+    ASSERT(addr >= Start + ALLOC_BLOCK_HEADER && addr < Current);
+
+    AllocBlock *blk = reinterpret_cast<AllocBlock*>(addr - ALLOC_BLOCK_HEADER);
 
     /* Now, we need to check if this is a valid block, and if we haven't called Deallocate on it before (double
      * free). */
 
     ASSERT(blk->Magic == ALLOC_BLOCK_MAGIC);
-    ASSERT(blk != Base && blk->Next == Null && blk->Prev == Null);
+    ASSERT(!(blk->Flags & ALLOC_BLOCK_FREE));
+
+    FreeBlock(blk);
+}
+
+Void Heap::FreeBlock(AllocBlock *Block) {
+    /* Fuse the block with the blocks around it (using the boundary tags, so this is O(1)), we never have two free
+     * blocks next to each other. */
+
+    AllocBlock *blk = Block, *next;
+
+    if (blk != Last && ((next = GetNext(blk))->Flags & ALLOC_BLOCK_FREE)) {
+        RemoveFree(next);
+        FuseBlock(blk);
+    }
+
+    if (blk->PrevPhys != Null && (blk->PrevPhys->Flags & ALLOC_BLOCK_FREE)) {
+        RemoveFree(blk = blk->PrevPhys);
+        FuseBlock(blk);
+    }
+
+    /* If this is the last block (just at the end of the heap), let's free some space on the heap, else, just add it
+     * to the free lists. Increment expects everything between Current and CurrentAligned to be mapped, so if some of
+     * the pages of the block were unmapped, we give the whole tail back. */
+
+    if (blk == Last) {
+        Last = blk->PrevPhys;
+        blk->Magic = 0;
+        Decrement(blk->Size + ALLOC_BLOCK_HEADER);
+        if (blk->Flags & ALLOC_BLOCK_TRIMMED) ReturnTail(UINTPTR_MAX);
+    } else AddFree(blk);
+}
+
+Boolean Heap::ResizeBlock(AllocBlock *Block, UIntPtr Size) {
+    /* Shrinking is just splitting the block (and freeing the remainder, which may fuse with the next block, or give
+     * the space back to the heap). For growing, we can either fuse with the next block (if it's free and big enough),
+     * or, if we're the last block, just move the heap end. If the next block was trimmed, we also need to map back
+     * what we're going to use, and if anything fails, we split the block back into what it was. */
+
+    AllocBlock *next, *rem;
+    UIntPtr old = Block->Size;
+    Boolean ok = True;
+
+    if (Size > Block->Size && Block != Last) {
+        if (!((next = GetNext(Block))->Flags & ALLOC_BLOCK_FREE) ||
+            (next != Last && Block->Size + ALLOC_BLOCK_HEADER + next->Size < Size)) return False;
+
+        RemoveFree(next);
+        FuseBlock(Block);
+    }
+
+    if (Size > Block->Size && (ok = Increment(Size - Block->Size) == Status::Success)) Block->Size = Size;
+    if (ok && (Block->Flags & ALLOC_BLOCK_TRIMMED)) ok = MapBlock(Block, Size) == Status::Success;
+
+    if (!ok) {
+        if ((rem = SplitBlock(Block, old)) != Null) FreeBlock(rem);
+        return Block->Flags &= ~ALLOC_BLOCK_TRIMMED, False;
+    }
+
+    if ((rem = SplitBlock(Block, Size)) != Null) FreeBlock(rem);
+
+    return Block->Flags &= ~ALLOC_BLOCK_TRIMMED, True;
+}
+
+Void *Heap::Reallocate(Void *Address, UIntPtr Size) {
+    /* Just like realloc: Null means that we should just allocate, and a zero size means that we should just free. The
+     * contents are kept (up to the smallest of the two sizes), but anything after that is left uninitialized. When we
+     * can't resize in place, aligned allocations lose their alignment (as we don't know what it was). For the
+     * profiler, this counts as freeing the old allocation and making a new one (if we had to move, Deallocate already
+     * took care of the first part). */
+
+    Void *ret;
+
+    if (Address == Null) return AllocateUninit(Size);
+    else if (!Size) return Deallocate(Address), Null;
+    else if ((ret = ReallocInt(Address, Size)) == Null) return Null;
+    else if (ProfileLive && ret == Address) Unsample(Address);
+
+    return Profile(ret, Size);
+}
+
+Void *Heap::ReallocInt(Void *Address, UIntPtr Size) {
+    if (Size > UINTPTR_MAX - 15) return Null;
+
+    auto addr = reinterpret_cast<UIntPtr>(Address);
+    UIntPtr old;
+    Void *ret;
+
+    Size = (Size + 15) & -16;
 
-    /* Add this block to the free list, and start fusing it with other block around it. */
+    if (addr >= SlabBottom && addr < SlabTop) {
+        /* Slab objects can only stay where they are if the new size is still on the same class (so shrinking into a
+         * smaller class still frees the memory). */
 
-    AddFree(blk);
+        auto slab = reinterpret_cast<SlabHeader*>(addr & ~HEAP_SLAB_MASK);
+        UIntPtr first = reinterpret_cast<UIntPtr>(slab) + HEAP_SLAB_START;
 
-    while ((fblk = FuseBlock(blk->Prev)) != Null) blk = fblk;
-    while (FuseBlock(blk) != Null) ;
+        ASSERT(slab->Magic == ALLOC_SLAB_MAGIC && !slab->Trimmed && addr >= first);
+        ASSERT(!((addr - first) % SlabSizes[slab->Class]));
 
-    /* If this is the end of the block list, AND the block is just at the end of the heap, let's free some space on the
-     * heap. */
+        old = SlabSizes[slab->Class];
 
-    if (blk == Tail && reinterpret_cast<UIntPtr>(blk) == Current - (blk->Size + sizeof(AllocBlock))) {
-        if (blk->Prev != Null) {
-            Tail = blk->Prev;
-            Tail->Next = Null;
-        } else Base = Tail = Null;
-        Decrement(blk->Size + sizeof(AllocBlock));
+        if (Size <= HEAP_SLAB_MAX && SlabIndex[Size >> 4] == slab->Class) return Address;
+    } else if (addr >= LargeStart && addr < LargeCurrent) {
+        /* Large allocations can grow into the free space just after them (or shrink, giving the pages at the end back
+         * to PhysMem), as long as they are still big enough to be large allocations. */
+
+        auto hdr = reinterpret_cast<LargeHeader*>(Address) - 1;
+
+        ASSERT(hdr->Magic == ALLOC_LARGE_MAGIC);
+
+        if (Size >= HEAP_LARGE_MIN && ResizeLarge(hdr, Size)) return Address;
+
+        old = (reinterpret_cast<UIntPtr>(hdr) & ~PAGE_MASK) + (hdr->Pages << PAGE_SHIFT) - addr;
+    } else {
+        ASSERT(addr >= Start + ALLOC_BLOCK_HEADER && addr < Current);
+
+        auto blk = reinterpret_cast<AllocBlock*>(addr - ALLOC_BLOCK_HEADER);
+
+        ASSERT(blk->Magic == ALLOC_BLOCK_MAGIC);
+        ASSERT(!(blk->Flags & ALLOC_BLOCK_FREE));
+
+        /* Small sizes still go to the slab allocator (instead of wasting a whole block on them), and big ones to the
+         * large area. */
+
+        if (Size > HEAP_SLAB_MAX && Size < HEAP_LARGE_MIN && ResizeBlock(blk, Size)) return Address;
+
+        old = blk->Size;
     }
+
+    /* Couldn't do it in place, so allocate a new buffer, copy, and free the old one (if the allocation fails, the old
+     * buffer is still valid). */
+
+    if ((ret = AllocInt(Size, False)) == Null) return Null;
+
+    CopyMemory(ret, Address, old < Size ? old : Size);
+    Deallocate(Address);
+
+    return ret;
 }
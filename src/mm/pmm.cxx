@@ -1,10 +1,12 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on July 01 of 2020, at 19:47 BRT
- * Last edited on April 14 of 2021, at 18:05 BRT */
+ * Last edited on October 17 of 2026, at 23:59 BRT */
 
+#include <base/simd.hxx>
 #include <sys/mm.hxx>
 #include <sys/panic.hxx>
+#include <util/algo.hxx>
 #include <util/bitop.hxx>
 
 using namespace CHicago;
@@ -12,10 +14,26 @@ using namespace CHicago;
 /* All of the static private variables. */
 
 UIntPtr PhysMem::KernelStart = 0, PhysMem::KernelEnd = 0, PhysMem::RegionCount = 0,
-        PhysMem::MinAddress = 0, PhysMem::MaxAddress = 0, PhysMem::MaxBytes = 0, PhysMem::UsedBytes = 0;
+        PhysMem::MinAddress = 0, PhysMem::MaxAddress = 0, PhysMem::MaxBytes = 0, PhysMem::UsedBytes = 0,
+        PhysMem::FrameCount = 0, PhysMem::SummaryCount = 0, PhysMem::CachedBytes = 0, PhysMem::ZeroCount = 0,
+        PhysMem::ZeroPool[PHYS_ZERO_POOL_SIZE], PhysMem::NodeCount = 1, PhysMem::NodeRangeCount = 0,
+        PhysMem::NodeBounds[PHYS_MAX_NODE_RANGES * 2], PhysMem::NodeBoundCount = 0, PhysMem::ReadyCount = 0,
+        PhysMem::ReadyAddress = 0, PhysMem::DeferredBytes = 0, PhysMem::DeferredCount = 0,
+        PhysMem::ContigFailures = 0, PhysMem::EmergencyReclaims = 0, PhysMem::AllocLatency[PHYS_STAT_BUCKETS],
+        PhysMem::FreeLatency[PHYS_STAT_BUCKETS], PhysMem::CompactCursor = 0, PhysMem::Compactions = 0,
+        PhysMem::MigratedPages = 0, PhysMem::ProactiveReclaims = 0, PhysMem::ShrinkerCount = 0;
+UIntPtr *PhysMem::RegionSummary = Null, *PhysMem::TopSummary = Null;
 PhysMem::Region *PhysMem::Regions = Null;
 UInt8 *PhysMem::References = Null;
-Boolean PhysMem::Initialized = False;
+UInt16 *PhysMem::HugeFree = Null;
+PhysMem::Frame *PhysMem::Frames = Null;
+PhysMem::Zone PhysMem::Zones[PHYS_MAX_NODES];
+PhysMem::NodeRange PhysMem::NodeRanges[PHYS_MAX_NODE_RANGES];
+PhysMem::DeferredRange PhysMem::DeferredRanges[PHYS_MAX_DEFERRED_RANGES];
+UInt8 PhysMem::LocalNode = 0;
+PhysMem::Magazine PhysMem::Magazines[PHYS_MAX_CPUS];
+PhysMem::Shrinker PhysMem::Shrinkers[PHYS_MAX_SHRINKERS];
+Boolean PhysMem::Initialized = False, PhysMem::Shrinking = False, PhysMem::ReclaimBackoff = False;
 
 Void PhysMem::Initialize(BootInfo &Info) {
     /* This function should only be called once by the kernel entry. It is responsible for initializing the physical
@@ -45,6 +63,7 @@ Void PhysMem::Initialize(BootInfo &Info) {
     KernelEnd = Info.KernelEnd;
     MinAddress = Info.MinPhysicalAddress;
     MaxAddress = Info.MaxPhysicalAddress;
+    ReadyAddress = MinAddress;
     MaxBytes = Info.PhysicalMemorySize;
     UsedBytes = MaxBytes;
 
@@ -59,20 +78,12 @@ Void PhysMem::Initialize(BootInfo &Info) {
     Regions = reinterpret_cast<PhysMem::Region*>(start);
     References = &start[RegionCount * sizeof(PhysMem::Region)];
 
-    /* Now, let's clear the region list and the reference list (set all the entries on the region list to be already
-     * used, and all the entries on the references list to have 0 references). */
-
-    for (UIntPtr i = 0; i < RegionCount; i++) {
-        Regions[i].Free = 0;
-        Regions[i].Used = PHYS_REGION_PSIZE;
-        SetMemory(Regions[i].Pages, 0xFF, sizeof(Regions[i].Pages));
-    }
-
-    SetMemory(References, 0, (Info.MaxPhysicalAddress - Info.MinPhysicalAddress) >> PAGE_SHIFT);
-
-    /* Now using the boot memory map, we can free the free (duh) regions (those entries will be marked as
-     * BOOT_INFO_MEM_FREE). Also, if we find some 0-base entry after the first entry, it is probably some entry that
-     * goes beyond the UIntPtr size (like some PAE entry on x86), and we don't support those (yet). */
+    /* Clearing the region list and the reference list (and freeing the free ranges of the memory map) takes time
+     * proportional to the amount of physical memory, which is a lot on big machines. So, we only save the free ranges
+     * for now (those entries will be marked as BOOT_INFO_MEM_FREE), and initialize the regions in batches, starting
+     * with only enough regions to boot (the rest is done by InitializeDeferred, either when we run out of memory, or
+     * when the kernel entry calls it). Also, if we find some 0-base entry after the first entry, it is probably some
+     * entry that goes beyond the UIntPtr size (like some PAE entry on x86), and we don't support those (yet). */
 
     for (UIntPtr i = 0; i < Info.MemoryMap.Count; i++) {
         BootInfoMemMap &ent = Info.MemoryMap.Entries[i];
@@ -85,24 +96,205 @@ Void PhysMem::Initialize(BootInfo &Info) {
         Debug.Write("memory map entry no. {}, base = 0x{:0*:16}, size = 0x{:0:16}, type = {}\n", i, ent.Base,
                     ent.Count << 12, ent.Type);
 
-        if (ent.Type == 0x06 && ent.Base) FreeInt(ent.Base, ent.Count);
-        else if (ent.Type == 0x06 && ent.Count > 1) FreeInt(ent.Base + PAGE_SIZE, ent.Count - 1);
+        if (ent.Type == BOOT_INFO_MEM_FREE && ent.Base) DeferRange(ent.Base, ent.Count);
+        else if (ent.Type == BOOT_INFO_MEM_FREE && ent.Count > 1) DeferRange(ent.Base + PAGE_SIZE, ent.Count - 1);
+    }
+
+    /* Enough to boot means enough for the frame descriptor array (allocated by FinishInitialization), plus some extra
+     * memory for everything else. */
+
+    UIntPtr boot = ((MaxAddress - MinAddress) >> PAGE_SHIFT) * sizeof(Frame) + PHYS_BOOT_FREE_SIZE;
+
+    while (ReadyCount < RegionCount && MaxBytes - UsedBytes < boot) InitializeDeferred(PHYS_DEFER_BATCH);
+
+    Debug.Write("initialized {} of {} physical memory regions, 0x{:0:16} bytes were deferred\n", ReadyCount,
+                RegionCount, DeferredBytes);
+
+    Debug.Write("0x{:0:16} bytes of physical memory are being used, and 0x{:0:16} are free\n", GetUsage(),
+                GetFree());
+
+    Initialized = True;
+}
+
+Void PhysMem::FinishInitialization() {
+    /* This should be called after VirtMem::Initialize, as the frame descriptor array is allocated on the kernel heap.
+     * Until now, everything went through the bitmap scanning path of AllocInt, now we can build the buddy allocator
+     * free lists using the current state of the bitmap (which already accounts for the descriptor array itself). */
+
+    ASSERT(Initialized && Frames == Null && RegionSummary == Null);
+
+    UIntPtr count = (MaxAddress - MinAddress) >> PAGE_SHIFT, ready = (ReadyAddress - MinAddress) >> PAGE_SHIFT,
+            start = 0, run = 0;
+
+    /* First, setup the upper levels of the free summary: one bit for each region that isn't full, and one bit for each
+     * word of that first level that isn't zero. The bitmap scanning path (which is still used as the fallback of the
+     * buddy allocator, or as the only allocator, if we can't use the buddy allocator) can then find free pages using a
+     * few bit scans, instead of going through all the regions. */
+
+    SummaryCount = (RegionCount + PHYS_REGION_BITMAP_PSIZE - 1) / PHYS_REGION_BITMAP_PSIZE;
+
+    if ((RegionSummary = new UIntPtr[SummaryCount + (SummaryCount + PHYS_REGION_BITMAP_PSIZE - 1) /
+                                                    PHYS_REGION_BITMAP_PSIZE]) != Null) {
+        TopSummary = &RegionSummary[SummaryCount];
+        SetMemory(RegionSummary, 0, (SummaryCount + (SummaryCount + PHYS_REGION_BITMAP_PSIZE - 1) /
+                                                    PHYS_REGION_BITMAP_PSIZE) * sizeof(UIntPtr));
+        for (UIntPtr i = 0; i < ReadyCount; i++) UpdateSummary(i);
+    }
+
+    if (count >= FRAME_NONE) {
+        Debug.SetForeground(0xFFFFFF00);
+        Debug.Write("too many physical pages for the buddy allocator, only the bitmap allocator will be used\n");
+        Debug.RestoreForeground();
+        return;
+    }
+
+    for (Zone &zone : Zones) {
+        for (UIntPtr i = 0; i <= PHYS_MAX_ORDER; i++) zone.FreeLists[i] = FRAME_NONE;
+    }
+
+    /* Besides the frame descriptors, we also keep one counter for each huge page sized frame, with how many of its
+     * pages are free on blocks smaller than a huge page (the frames that are completely free are the blocks on the
+     * free lists with order >= PHYS_HUGE_ORDER). */
+
+    if ((HugeFree = new UInt16[GetHugeIndex(count - 1) + 1]) == Null || (Frames = new Frame[count]) == Null) {
+        Debug.SetForeground(0xFFFFFF00);
+        Debug.Write("couldn't allocate the page frame descriptors, only the bitmap allocator will be used\n");
+        Debug.RestoreForeground();
+
+        if (HugeFree != Null) delete[] HugeFree;
+        HugeFree = Null;
+
+        return;
+    }
+
+    FrameCount = count;
+    SetMemory(HugeFree, 0, (GetHugeIndex(count - 1) + 1) * sizeof(UInt16));
+    SetMemory(Frames, 0, count * sizeof(Frame));
+
+    /* Tag each frame with its node (anything that isn't covered by the SRAT stays on node 0), and save where each
+     * node starts (TakePages uses it to start scanning on the local node), and where the node changes (so that
+     * GetNodeEnd doesn't need to go through all the ranges). */
+
+    for (UIntPtr i = 0; i < NodeRangeCount; i++) {
+        NodeRange &range = NodeRanges[i];
+        UIntPtr start = range.Start < MinAddress ? 0 : (range.Start - MinAddress) >> PAGE_SHIFT,
+                end = range.End > MaxAddress ? count : (range.End - MinAddress) >> PAGE_SHIFT;
+
+        for (UIntPtr j = start; j < end; j++) Frames[j].Node = range.Node;
+    }
+
+    for (UIntPtr i = 0; i < count; i++) {
+        if (!Zones[Frames[i].Node].Size++) Zones[Frames[i].Node].First = i;
+        if (i && Frames[i].Node != Frames[i - 1].Node && NodeBoundCount < sizeof(NodeBounds) / sizeof(UIntPtr)) {
+            NodeBounds[NodeBoundCount++] = i;
+        }
+    }
+
+    /* The pages that are already sitting on the magazines need to be flagged (so that FreeSingle can catch double
+     * frees). */
+
+    for (Magazine &mag : Magazines) {
+        for (UIntPtr i = 0; i < mag.Count; i++) Frames[(mag.Pages[i] - MinAddress) >> PAGE_SHIFT].Flags |= FRAME_CACHED;
+    }
+
+    for (UIntPtr i = 0; i < ZeroCount; i++) Frames[(ZeroPool[i] - MinAddress) >> PAGE_SHIFT].Flags |= FRAME_CACHED;
+
+    /* The reference counts that were taken until now (by VirtMem::Initialize and the first heap expansions) are still
+     * on the byte array, move them into the (wider) counters on the descriptors. */
+
+    for (UIntPtr i = 0; i < ready; i++) Frames[i].References = References[i];
+
+    /* Now just go through each bitmap word, collecting the runs of free pages (which may cross into the next words or
+     * regions), and insert them into the free lists. The regions that haven't been initialized yet are skipped, their
+     * pages get inserted by FreeInt once InitializeDeferred frees them. */
+
+    for (UIntPtr i = 0; i < ready; i += PHYS_REGION_BITMAP_PSIZE) {
+        UIntPtr map = Regions[i / PHYS_REGION_PSIZE].Pages[(i / PHYS_REGION_BITMAP_PSIZE) &
+                                                           (PHYS_REGION_BITMAP_LEN - 1)];
+
+        for (UIntPtr k = 0; k < PHYS_REGION_BITMAP_PSIZE;) {
+            UIntPtr rest = map >> k, cnt;
+
+            if (rest & 1) {
+                if (run) InsertRange(start, run), run = 0;
+                k += BitOp::ScanForward(~rest);
+                continue;
+            } else if ((cnt = BitOp::ScanForward(rest)) > PHYS_REGION_BITMAP_PSIZE - k) {
+                cnt = PHYS_REGION_BITMAP_PSIZE - k;
+            }
+
+            if (!run) start = i + k;
+
+            run += cnt;
+            k += cnt;
+        }
     }
 
-    Debug.Write("0x{:0:16} bytes of physical memory are being used, and 0x{:0:16} are free\n", UsedBytes,
-                MaxBytes - UsedBytes);
+    if (run) InsertRange(start, start + run > ready ? ready - start : run);
+
+    Debug.Write("initialized the buddy allocator, there are {} page frames on {} node(s)\n", FrameCount, NodeCount);
+
+    for (UIntPtr i = 0; i < NodeCount; i++) {
+        Debug.Write("node {} has {} frames ({} free), and the free order mask is 0x{:0:16}\n", i, Zones[i].Size,
+                    Zones[i].Free, Zones[i].FreeMask);
+    }
 }
 
 /* Most of the alloc/free functions only redirect to the AllocInt function, the exception for this is the NonContig
- * functions, as the allocated memory pages DON'T need to be contiguous, so we can alloc one-by-one (which have
- * a lower chance of failing, as in the contig functions, the pages have to be on the same region). */
+ * functions, as the allocated memory pages DON'T need to be contiguous, so we can take all the free pages of each
+ * bitmap word at once (which also have a lower chance of failing, as in the contig functions, the pages have to be on
+ * the same region), and the Single functions, which go through the per-CPU magazines. */
+
+Status PhysMem::AllocSingle(UIntPtr &Out, UIntPtr Align, UInt32 Flags) {
+    /* If the caller wants a zeroed page, try taking one from the zero pool first. Other than that, anything that needs
+     * more than page alignment has to go through AllocInt, everything else can just pop the last page that went into
+     * the magazine (which is also the one most likely to still be on the cache). */
+
+    Magazine &mag = GetMagazine();
+    Status status = Status::Success;
+
+    if ((Flags & ALLOC_ZERO) && ZeroCount && Align <= PAGE_SIZE) {
+        Out = ZeroPool[--ZeroCount];
+        CachedBytes -= PAGE_SIZE;
+        if (Frames != Null) Frames[(Out - MinAddress) >> PAGE_SHIFT].Flags &= ~FRAME_CACHED;
+        return Status::Success;
+    } else if (!Initialized || Align > PAGE_SIZE) status = AllocInt(1, Out, Align);
+    else if (!mag.Count && RefillMagazine(mag) != Status::Success) return Status::OutOfMemory;
+    else {
+        Out = mag.Pages[--mag.Count];
+        CachedBytes -= PAGE_SIZE;
+        if (Frames != Null) Frames[(Out - MinAddress) >> PAGE_SHIFT].Flags &= ~FRAME_CACHED;
+    }
+
+    /* The zero pool was empty, so we need to zero the page ourselves. */
+
+    if (status != Status::Success || !(Flags & ALLOC_ZERO)) return status;
+    else if ((status = ZeroPage(Out)) != Status::Success) FreeSingle(Out);
 
-Status PhysMem::AllocSingle(UIntPtr &Out, UIntPtr Align) {
-    return AllocInt(1, Out, Align);
+    return status;
 }
 
 Status PhysMem::AllocContig(UIntPtr Count, UIntPtr &Out, UIntPtr Align) {
-    return AllocInt(Count, Out, Align);
+    Status status = AllocInt(Count, Out, Align);
+    if (status == Status::OutOfMemory && Count > 1) ContigFailures++;
+    return status;
+}
+
+Status PhysMem::AllocHuge(UIntPtr &Out, UIntPtr Count) {
+    /* Allocate Count consecutive huge page sized (and aligned) frames. This is just AllocInt, but as those requests are
+     * always huge page aligned, they should be handled by the buddy allocator without any bitmap scanning (and for a
+     * single huge page, the buddy allocator either has it, or nobody has). */
+
+    if (!Count || (Count << PHYS_HUGE_ORDER) >> PHYS_HUGE_ORDER != Count) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid PhysMem::AllocHuge arguments (count = {})\n", Count);
+        Debug.RestoreForeground();
+        return Status::InvalidArg;
+    }
+
+    Status status = AllocInt(Count << PHYS_HUGE_ORDER, Out, HUGE_PAGE_SIZE);
+    if (status == Status::OutOfMemory) ContigFailures++;
+    return status;
 }
 
 Status PhysMem::AllocNonContig(UIntPtr Count, UIntPtr *Out, UIntPtr Align) {
@@ -117,62 +309,136 @@ Status PhysMem::AllocNonContig(UIntPtr Count, UIntPtr *Out, UIntPtr Align) {
         return Status::InvalidArg;
     }
 
-    UIntPtr addr;
-    Status status;
+    /* If we need more than page alignment, or if we're going to need to reclaim memory, just go page-by-page (and let
+     * AllocSingle/AllocInt handle it). */
 
-    for (UIntPtr i = 0; i < Count; i++) {	
-        if ((status = AllocSingle(addr, Align)) != Status::Success) {
-            FreeNonContig(Out, i);
-            return status;
+    Magazine &mag = GetMagazine();
+
+    if (!Initialized || Align > PAGE_SIZE ||
+        (Count > mag.Count && UsedBytes + ((Count - mag.Count) << PAGE_SHIFT) > MaxBytes)) {
+        UIntPtr addr;
+        Status status;
+
+        for (UIntPtr i = 0; i < Count; i++) {
+            if ((status = AllocSingle(addr, Align)) != Status::Success) {
+                if (i) FreeNonContig(Out, i);
+                return status;
+            }
+
+            Out[i] = addr;
         }
 
-        Out[i] = addr;
+        return Status::Success;
+    }
+
+    /* Otherwise, empty the magazine first (those pages are already off the bitmap), and take the rest straight from
+     * the bitmap. */
+
+    UIntPtr i = 0;
+
+    for (; i < Count && mag.Count; i++) {
+        Out[i] = mag.Pages[--mag.Count];
+        CachedBytes -= PAGE_SIZE;
+        if (Frames != Null) Frames[(Out[i] - MinAddress) >> PAGE_SHIFT].Flags &= ~FRAME_CACHED;
+    }
+
+    if (i < Count && (i += TakePages(Count - i, &Out[i])) < Count) {
+        if (i) FreeNonContig(Out, i);
+        return Status::OutOfMemory;
     }
 
     return Status::Success;
 }
 
 Status PhysMem::FreeSingle(UIntPtr Page) {
-    return FreeInt(Page, 1);
+    /* Same checks as FreeInt, but we also need to make sure that the page isn't already on some magazine (which we can
+     * only do after FinishInitialization). If the magazine is full, we drain the oldest half of it back into the
+     * bitmap before pushing the page. */
+
+    Magazine &mag = GetMagazine();
+
+    if (!Initialized || !Page || (Page & PAGE_MASK) || Page < MinAddress || Page >= ReadyAddress ||
+        !CheckPages(Page - MinAddress, 1, True) ||
+        (Frames != Null && (Frames[(Page - MinAddress) >> PAGE_SHIFT].Flags & FRAME_CACHED))) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid PhysMem::FreeSingle arguments (page = 0x{:0*:16})\n", Page);
+        Debug.RestoreForeground();
+        return Status::InvalidArg;
+    } else if (mag.Count >= PHYS_MAGAZINE_SIZE) DrainMagazine(mag, PHYS_MAGAZINE_BATCH);
+
+    mag.Pages[mag.Count++] = Page;
+    CachedBytes += PAGE_SIZE;
+
+    if (Frames != Null) Frames[(Page - MinAddress) >> PAGE_SHIFT].Flags |= FRAME_CACHED;
+
+    return Status::Success;
 }
 
 Status PhysMem::FreeContig(UIntPtr Start, UIntPtr Count) {
     return FreeInt(Start, Count);
 }
 
+Status PhysMem::FreeHuge(UIntPtr Start, UIntPtr Count) {
+    if ((Start & HUGE_PAGE_MASK) || !Count || (Count << PHYS_HUGE_ORDER) >> PHYS_HUGE_ORDER != Count) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid PhysMem::FreeHuge arguments (start = 0x{:0*:16}, count = {})\n", Start, Count);
+        Debug.RestoreForeground();
+        return Status::InvalidArg;
+    }
+
+    return FreeInt(Start, Count << PHYS_HUGE_ORDER);
+}
+
 Status PhysMem::FreeNonContig(UIntPtr *Pages, UIntPtr Count) {
-    /* This is the same as AllocNonContig, but instead of calling AllocSingle, we call FreeSingle, and we don't need
-     * to save anything after doing that. */
+    /* This is the same as AllocNonContig, but in reverse: We sort the pages (so that the caller's array WILL be
+     * reordered), so that all the pages that are on the same bitmap word end up together, validate all of them
+     * (before freeing anything), and clear them one bitmap word at a time. */
 
-    if (!Count || Pages == Null) {
+    if (!Initialized || !Count || Pages == Null) {
         Debug.SetForeground(0xFFFF0000);
         Debug.Write("invalid non-contig PhysMem::Free arguments (pages = 0x{:0*:16}, count = {})\n", Pages, Count);
         Debug.RestoreForeground();
         return Status::InvalidArg;
     }
 
-    Status status;
+    Sort(Pages, &Pages[Count], [](UIntPtr A, UIntPtr B) { return A < B; });
 
-    for (UIntPtr i = 0; i < Count; i++) if ((status = FreeSingle(Pages[i])) != Status::Success) return status;
+    for (UIntPtr i = 0; i < Count; i++) {
+        UIntPtr page = Pages[i];
 
-    return Status::Success;
+        if (!page || (page & PAGE_MASK) || page < MinAddress || page >= ReadyAddress || (i && page == Pages[i - 1]) ||
+            !CheckPages(page - MinAddress, 1, True) ||
+            (Frames != Null && (Frames[(page - MinAddress) >> PAGE_SHIFT].Flags & FRAME_CACHED))) {
+            Debug.SetForeground(0xFFFF0000);
+            Debug.Write("invalid non-contig PhysMem::Free arguments (page = 0x{:0*:16})\n", page);
+            Debug.RestoreForeground();
+            return Status::InvalidArg;
+        }
+    }
+
+    return ReleasePages(Pages, Count), Status::Success;
 }
 
-Status PhysMem::ReferenceSingle(UIntPtr Page, UIntPtr &Out, UIntPtr Align) {
+Status PhysMem::ReferenceSingle(UIntPtr Page, UIntPtr &Out, UIntPtr Align, UInt32 Flags) {
     /* For referencing single pages, we can just check if we need to alloc a new page (if we do we self call us with
      * said new allocated page), and increase the reference counter for the page. */
 
     if (!Page) {
-        Status status = AllocSingle(Page, Align);
+        Status status = AllocSingle(Page, Align, Flags);
         if (status != Status::Success) return status;
         return ReferenceSingle(Page, Out, Align);
     } else if (References == Null || UsedBytes < PAGE_SIZE || (Page & PAGE_MASK) || Page < MinAddress ||
-               Page >= MaxAddress) {
+               Page >= ReadyAddress) {
         Debug.SetForeground(0xFFFF0000);
         Debug.Write("invalid PhysMem::Reference arguments (page = 0x{:0*:16})\n", Page);
         Debug.RestoreForeground();
         return Status::InvalidArg;
-    } else if (References[(Page - MinAddress) >> PAGE_SHIFT] < 0xFF) References[(Page - MinAddress) >> PAGE_SHIFT]++;
+    } else if (!IncrementReferences((Page - MinAddress) >> PAGE_SHIFT)) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("reference count overflow on PhysMem::Reference (page = 0x{:0*:16})\n", Page);
+        Debug.RestoreForeground();
+        return Status::InvalidArg;
+    }
 
     Out = Page & ~PAGE_MASK;
 
@@ -180,8 +446,9 @@ Status PhysMem::ReferenceSingle(UIntPtr Page, UIntPtr &Out, UIntPtr Align) {
 }
 
 Status PhysMem::ReferenceContig(UIntPtr Start, UIntPtr Count, UIntPtr &Out, UIntPtr Align) {
-    /* Referencing multiple contig pages is also pretty simple, same checks as the other function, but we need to
-     * reference all the pages in a loop. */
+    /* Referencing multiple contig pages is also pretty simple, same checks as the other function (but only once for
+     * the whole range), and then we increase the ref count of all the pages in a loop (undoing everything if any of
+     * the counters would overflow). */
 
     Status status;
 
@@ -189,18 +456,23 @@ Status PhysMem::ReferenceContig(UIntPtr Start, UIntPtr Count, UIntPtr &Out, UInt
         if ((status = AllocContig(Count, Start, Align)) != Status::Success) return status;
         return ReferenceContig(Start, Count, Out, Align);
     } else if (References == Null || !Count || UsedBytes < (Count << PAGE_SHIFT) || (Start & PAGE_MASK) ||
-               Start < MinAddress || Start + (Count << PAGE_SHIFT) > MaxAddress) {
+               Start < MinAddress || Start + (Count << PAGE_SHIFT) > ReadyAddress) {
         Debug.SetForeground(0xFFFF0000);
         Debug.Write("invalid contig PhysMem::Reference arguments (start = 0x{:0*:16}, count = {})\n", Start, Count);
         Debug.RestoreForeground();
         return Status::InvalidArg;
     }
 
-    for (UIntPtr i = 0, discard = 0; i < Count; i++) {
-        if ((status = ReferenceSingle(Start + (i << PAGE_SHIFT), discard)) != Status::Success) {
-            DereferenceContig(Start, Count);
-            return status;
-        }
+    for (UIntPtr i = 0, idx = (Start - MinAddress) >> PAGE_SHIFT; i < Count; i++) {
+        if (IncrementReferences(idx + i)) continue;
+
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("reference count overflow on PhysMem::Reference (page = 0x{:0*:16})\n", Start + (i << PAGE_SHIFT));
+        Debug.RestoreForeground();
+
+        for (Boolean last; i--;) DecrementReferences(idx + i, last);
+
+        return Status::InvalidArg;
     }
 
     Out = Start;
@@ -234,38 +506,56 @@ Status PhysMem::DereferenceSingle(UIntPtr Page) {
     /* Dereferencing is pretty easy: Make sure that we referenced the address before, if we have, decrease the ref
      * count, and if we were the last ref to the address, dealloc it. */
 
+    Boolean last = False;
+
     if (References == Null || UsedBytes < PAGE_SIZE || !Page || (Page & PAGE_MASK) || Page < MinAddress ||
-        Page >= MaxAddress || !References[(Page - MinAddress) >> PAGE_SHIFT]) {
+        Page >= ReadyAddress || !DecrementReferences((Page - MinAddress) >> PAGE_SHIFT, last)) {
         Debug.SetForeground(0xFFFF0000);
         Debug.Write("invalid PhysMem::Dereference arguments (page = 0x{:0*:16})\n", Page);
         Debug.RestoreForeground();
         return Status::InvalidArg;
     }
 
-    if (!(References[(Page - MinAddress) >> PAGE_SHIFT]--)) return FreeSingle(Page);
-    return Status::Success;
+    return last ? FreeSingle(Page) : Status::Success;
 }
 
-/* Dereferencing contig pages and non-contig pages is pretty much the same process, but on contig pages, we can just
- * add 'i * PAGE_SIZE' to the start address to get the page, on non-contig, we just need to access Pages[i] to get
- * the page. */
-
 Status PhysMem::DereferenceContig(UIntPtr Start, UIntPtr Count) {
     if (References == Null || !Count || UsedBytes < (Count << PAGE_SHIFT) || !Start || (Start & PAGE_MASK) ||
-        Start < MinAddress || Start + (Count << PAGE_SHIFT) > MaxAddress) {
+        Start < MinAddress || Start + (Count << PAGE_SHIFT) > ReadyAddress) {
         Debug.SetForeground(0xFFFF0000);
         Debug.Write("Invalid contig PhysMem::Dereference arguments (start = 0x{:0*:16}, count = {})\n", Start, Count);
         Debug.RestoreForeground();
         return Status::InvalidArg;
     }
 
-    Status status;
+    /* Make sure that all the pages are referenced before touching anything, and then decrease the ref counts, freeing
+     * each run of pages that reached zero at once (instead of going through FreeSingle for each of them). */
+
+    UIntPtr idx = (Start - MinAddress) >> PAGE_SHIFT, run = 0;
 
     for (UIntPtr i = 0; i < Count; i++) {
-        if ((status = DereferenceSingle(Start + (i << PAGE_SHIFT))) != Status::Success) return status;
+        if (ReadReferences(idx + i)) continue;
+
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("Invalid contig PhysMem::Dereference arguments (page = 0x{:0*:16})\n", Start + (i << PAGE_SHIFT));
+        Debug.RestoreForeground();
+
+        return Status::InvalidArg;
     }
 
-    return Status::Success;
+    for (UIntPtr i = 0; i < Count; i++) {
+        Boolean last = False;
+
+        if (DecrementReferences(idx + i, last) && last) {
+            run++;
+            continue;
+        } else if (run) {
+            FreeInt(Start + ((i - run) << PAGE_SHIFT), run);
+            run = 0;
+        }
+    }
+
+    return run ? FreeInt(Start + ((Count - run) << PAGE_SHIFT), run) : Status::Success;
 }
 
 Status PhysMem::DereferenceNonContig(UIntPtr *Pages, UIntPtr Count) {
@@ -273,234 +563,1220 @@ Status PhysMem::DereferenceNonContig(UIntPtr *Pages, UIntPtr Count) {
         Debug.SetForeground(0xFFFF0000);
         Debug.Write("invalid non-contig PhysMem::Dereference arguments (pages = 0x{:0*:16}, count = {})\n",
                     Pages, Count);
-         Debug.SetForeground(0xFFFFFFF);
+        Debug.RestoreForeground();
         return Status::InvalidArg;
     }
 
-    Status status;
-    for (UIntPtr i = 0; i < Count; i++) if ((status = DereferenceSingle(Pages[i])) != Status::Success) return status;
+    /* Same as FreeNonContig: sort the pages (the same page may appear multiple times, as long as it has enough
+     * references), validate everything, and then decrease the ref counts, moving the pages that reached zero to the
+     * start of the array, so that we can free all of them at once. */
+
+    Sort(Pages, &Pages[Count], [](UIntPtr A, UIntPtr B) { return A < B; });
+
+    for (UIntPtr i = 0, run = 1; i < Count; i++) {
+        UIntPtr page = Pages[i];
+
+        run = i && page == Pages[i - 1] ? run + 1 : 1;
+
+        if (!page || (page & PAGE_MASK) || page < MinAddress || page >= ReadyAddress ||
+            ReadReferences((page - MinAddress) >> PAGE_SHIFT) < run) {
+            Debug.SetForeground(0xFFFF0000);
+            Debug.Write("invalid non-contig PhysMem::Dereference arguments (page = 0x{:0*:16})\n", page);
+            Debug.RestoreForeground();
+            return Status::InvalidArg;
+        }
+    }
+
+    UIntPtr count = 0;
+
+    for (UIntPtr i = 0; i < Count; i++) {
+        Boolean last = False;
+        if (DecrementReferences((Pages[i] - MinAddress) >> PAGE_SHIFT, last) && last) Pages[count++] = Pages[i];
+    }
+
+    if (count) ReleasePages(Pages, count);
+
     return Status::Success;
 }
 
-UInt8 PhysMem::GetReferences(UIntPtr Page) {
+UInt32 PhysMem::GetReferences(UIntPtr Page) {
     if (References == Null || !Page || Page < PAGE_SIZE || (Page & PAGE_MASK) || Page < MinAddress ||
-        Page >= MaxAddress) {
+        Page >= ReadyAddress) {
         Debug.SetForeground(0xFFFF0000);
         Debug.Write("Invalid PhysMem::GetReference arguments (page = 0x{:0*:16})\n", Page);
         Debug.RestoreForeground();
         return 0;
     }
 
-    return References[(Page - MinAddress) >> PAGE_SHIFT];
+    return ReadReferences((Page - MinAddress) >> PAGE_SHIFT);
 }
 
-Status PhysMem::FindFreePages(UIntPtr BitMap, UIntPtr Count, UIntPtr &Out, UIntPtr &Available) {
-    /* Each unset bit is one free page, for finding consecutive free pages, we can iterate through the bits of the
-     * bitmap and search for free bits. */
+/* The reference counts may be changed by multiple CPUs at the same time (without holding any lock), so, after the
+ * descriptors have been allocated, they are only accessed using atomic operations. Incrementing fails instead of
+ * wrapping around (or silently stopping at some max value, like the old byte counters did), and decrementing fails
+ * if the count is already zero (the caller can then reject the call, instead of underflowing the counter). */
 
-    for (UIntPtr bc = PHYS_REGION_BITMAP_PSIZE, i = 0; i < bc;) {
-        if (BitMap == UINTPTR_MAX) return Status::OutOfMemory;
-        else if (!BitMap) {
-            Out = i;
-            Available = bc - i >= Count ? 0 : bc - i;
-            return Available ? Status::OutOfMemory : Status::Success;
-        }
+UInt32 PhysMem::ReadReferences(UIntPtr Index) {
+    return Frames != Null ? __atomic_load_n(&Frames[Index].References, __ATOMIC_ACQUIRE) : References[Index];
+}
 
-        /* Well, we need to check how many unset bits we have, first, get the location of the first unset bit here,
-         * after that, count how many available bits we have. */
+Boolean PhysMem::IncrementReferences(UIntPtr Index) {
+    if (Frames == Null) {
+        if (References[Index] == 0xFF) return False;
+        return References[Index]++, True;
+    }
 
-        UIntPtr bit = BitOp::ScanForward(~BitMap);
-        UIntPtr aval = BitOp::ScanForward(BitOp::GetBits(BitMap, bit, bc - i - 1));
+    UInt32 *refs = &Frames[Index].References, old = __atomic_load_n(refs, __ATOMIC_RELAXED);
 
-        if (aval >= Count) {
-            Out = i + bit;
-            return Status::Success;
-        } else if (i + bit + aval == bc) {
-            /* There might be enough pages, but we need to cross into the next bitmap, let's set Out so that AllocInt
-             * knows that. */
+    do {
+        if (old == 0xFFFFFFFF) return False;
+    } while (!__atomic_compare_exchange_n(refs, &old, old + 1, True, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-            Out = i + bit;
-            Available = aval;
+    return True;
+}
 
-            return Status::OutOfMemory;
-        }
+Boolean PhysMem::DecrementReferences(UIntPtr Index, Boolean &Last) {
+    /* The last dereference will free the page, so it needs to see everything that was done by the other CPUs before
+     * they dropped their references (hence the acquire-release ordering). */
 
-        BitMap >>= bit + aval;
-        i += bit + aval;
+    if (Frames == Null) {
+        if (!References[Index]) return False;
+        return Last = !--References[Index], True;
     }
 
-    return Status::OutOfMemory;
+    UInt32 *refs = &Frames[Index].References, old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+
+    do {
+        if (!old) return False;
+    } while (!__atomic_compare_exchange_n(refs, &old, old - 1, True, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if ((Last = old == 1)) Frames[Index].Flags &= ~FRAME_MOVABLE;
+
+    return True;
 }
 
-Status PhysMem::AllocInt(UIntPtr Count, UIntPtr &Out, UIntPtr Align) {
-    /* We need to check if all of the arguments are valid, and if the physical memory manager have already been
-     * initialized. */
+Void PhysMem::SetMovable(UIntPtr Page, UIntPtr Virtual) {
+    /* Movable pages can be moved somewhere else by Compact (which copies them, and remaps the virtual address). The
+     * page should have a single reference (and be freed through DereferenceSingle), and it should only be mapped at
+     * the given address. Before FinishInitialization there is nowhere to save this, so those pages are never moved. */
 
-    if (!Count || !Align) {
+    if (Frames == Null) return;
+    else if (!Page || (Page & PAGE_MASK) || Page < MinAddress || Page >= ReadyAddress || (Virtual & PAGE_MASK)) {
         Debug.SetForeground(0xFFFF0000);
-        Debug.Write("invalid PhysMem::AllocInt arguments (count = {}, align = {})\n", Count, Align);
+        Debug.Write("invalid PhysMem::SetMovable arguments (page = 0x{:0*:16}, virtual = 0x{:0*:16})\n", Page, Virtual);
         Debug.RestoreForeground();
-        return Status::InvalidArg;
-    } else if (Regions == Null || UsedBytes + (Count << PAGE_SHIFT) > MaxBytes) {
-        Debug.SetForeground(0xFFFF0000);
-        Debug.Write("not enough free memory for PhysMem::AllocInt (count = {})\n", Count);
+        return;
+    }
 
-        if (Regions != Null && (Heap::ReturnPhysical(), UsedBytes + (Count << PAGE_SHIFT) <= MaxBytes)) {
-            Debug.Write("enough memory seems to have been freed through Heap::ReturnPhysical\n");
-            Debug.RestoreForeground();
-        } else {
-            Debug.RestoreForeground();
-            return Status::OutOfMemory;
-        }
+    Frame &frm = Frames[(Page - MinAddress) >> PAGE_SHIFT];
+
+    frm.Mapping = Virtual;
+    frm.Flags |= FRAME_MOVABLE;
+}
+
+Status PhysMem::AddShrinker(const Shrinker &Value) {
+    /* The table is kept sorted by priority, so that Shrink can just go through it in order; Shrinkers with the same
+     * priority are called in the order they were added. */
+
+    if (Value.Count == Null || Value.Scan == Null) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid PhysMem::AddShrinker arguments (count = 0x{:0*:16}, scan = 0x{:0*:16})\n", Value.Count,
+                    Value.Scan);
+        Debug.RestoreForeground();
+        return Status::InvalidArg;
+    } else if (ShrinkerCount >= PHYS_MAX_SHRINKERS) {
+        Debug.SetForeground(0xFFFFFF00);
+        Debug.Write("too many shrinkers were registered, increase the PHYS_MAX_SHRINKERS value\n");
+        Debug.RestoreForeground();
+        return Status::OutOfMemory;
     }
 
-    Align -= 1;
+    UIntPtr i = ShrinkerCount++;
 
-    /* Now, we can just go through each region, and each bitmap in each region, and try to find the consecutive free
-     * pages that we were asked for. */
+    for (; i && Shrinkers[i - 1].Priority > Value.Priority; i--) Shrinkers[i] = Shrinkers[i - 1];
 
-    for (UIntPtr i = 0; i < RegionCount; i++) {
-        if (!Regions[i].Free) continue;
+    return Shrinkers[i] = Value, Status::Success;
+}
 
-        for (UIntPtr j = 0; j < PHYS_REGION_BITMAP_LEN; j++) {
-            if (Regions[i].Pages[j] == UINTPTR_MAX) continue;
+Status PhysMem::RemoveShrinker(const Shrinker &Value) {
+    for (UIntPtr i = 0; i < ShrinkerCount; i++) {
+        if (Shrinkers[i].Count != Value.Count || Shrinkers[i].Scan != Value.Scan) continue;
 
-            UIntPtr bit = 0, aval = 0;
+        for (ShrinkerCount--; i < ShrinkerCount; i++) Shrinkers[i] = Shrinkers[i + 1];
 
-            if (FindFreePages(Regions[i].Pages[j], Count, bit, aval) == Status::Success &&
-                !((Out = MinAddress + (i << PHYS_REGION_SHIFT) + (j << PHYS_REGION_PAGE_SHIFT) + (bit << PAGE_SHIFT))
-                       & Align)) {
-                /* Oh, we actually found enough free pages! we need to set all the bits that we're going to use,
-                 * increase the used bytes variable, and calculate the return value.
-                 * INFO: We can't use SetRange/UnsetRange as they take references (and we can't pass references to
-                 * packed fields to it). */
+        return Status::Success;
+    }
 
-                Regions[i].Pages[j] |= BitOp::GetMask(bit, bit + Count - 1);
+    return Status::DoesntExist;
+}
 
-                Regions[i].Free -= Count;
-                Regions[i].Used += Count;
-                UsedBytes += (Count << PAGE_SHIFT);
+UIntPtr PhysMem::Shrink(UIntPtr Pages) {
+    /* Ask each of the registered shrinkers (cheapest first) to give back what they can, until we have freed enough
+     * pages. The shrinkers are free to call into the allocator (unmapping something may free page tables, etc), but
+     * we shouldn't recurse into them from there. */
 
-                return Status::Success;
-            } else if (aval && !((Out = MinAddress + (i << PHYS_REGION_SHIFT) + (j << PHYS_REGION_PAGE_SHIFT) +
-                                                     (bit << PAGE_SHIFT)) & Align)) {
-                /* Differently from the normal error/out of memory in this region, if the output wasn't null it means
-                 * that we should try crossing into the next region/bitmap. */
+    UIntPtr freed = 0;
 
-                UIntPtr ci = i, cj = j, cur = aval;
+    if (Shrinking) return 0;
 
-                while (True) {
-                    UIntPtr cbit = 0, caval = 0;
-                
-                    if (++cj >= PHYS_REGION_BITMAP_LEN) {
-                        if (++ci >= RegionCount) break;
-                        cj = 0;
-                    }
+    Shrinking = True;
 
-                    if ((FindFreePages(Regions[ci].Pages[cj], Count - cur, cbit, caval) != Status::Success &&
-                        caval != PHYS_REGION_BITMAP_PSIZE) || cbit) {
-                        break;
-                    } else if (caval) {
-                        cur += caval;
-                        continue;
-                    }
+    for (UIntPtr i = 0; i < ShrinkerCount && freed < Pages; i++) {
+        UIntPtr count = Shrinkers[i].Count();
+        if (count) freed += Shrinkers[i].Scan(count < Pages - freed ? count : Pages - freed);
+    }
 
-                    /* Finally, we know that we have enough free physical memory (though it is going through multiple
-                     * region bitmaps lol)! First, update the first and last regions, as the might be only partially
-                     * filled. */
+    Shrinking = False;
 
-                    Regions[i].Free -= aval;
-                    Regions[i].Used += aval;
-                    Regions[ci].Free -= Count - cur;
-                    Regions[ci].Used += Count - cur;
+    return freed;
+}
 
-                    Regions[i].Pages[j] |= BitOp::GetMask(bit, bit + aval - 1);
-                    Regions[ci].Pages[cj] |= BitOp::GetMask(cbit, cbit + Count - cur - 1);
+Boolean PhysMem::IsMovable(UIntPtr Index) {
+    /* The flag alone is not enough (the page might have been freed without going through DereferenceSingle), so also
+     * make sure that the saved address is still mapped to this page. */
 
-                    /* Now fill the remaining/middle regions (first for the first and last i values, and then for the
-                     * middle ones, which we will be able to set to all used). */
+    UIntPtr phys;
+    UInt32 flags;
 
-                    for (cj++; cj < PHYS_REGION_BITMAP_LEN; cj++) {
-                        Regions[ci].Free -= PHYS_REGION_BITMAP_PSIZE;
-                        Regions[ci].Used += PHYS_REGION_BITMAP_PSIZE;
-                        Regions[ci].Pages[cj] = UINTPTR_MAX;
-                    }
+    return (Frames[Index].Flags & (FRAME_MOVABLE | FRAME_CACHED)) == FRAME_MOVABLE && ReadReferences(Index) == 1 &&
+           VirtMem::Query(Frames[Index].Mapping, phys, flags) == Status::Success && !(flags & MAP_HUGE) &&
+           phys == MinAddress + (Index << PAGE_SHIFT);
+}
 
-                    for (cj = j + 1; cj < PHYS_REGION_BITMAP_LEN; cj++) {
-                        Regions[i].Free -= PHYS_REGION_BITMAP_PSIZE;
-                        Regions[i].Used += PHYS_REGION_BITMAP_PSIZE;
-                        Regions[i].Pages[cj] = UINTPTR_MAX;
-                    }
+Status PhysMem::MigratePage(UIntPtr Index) {
+    /* Copy the page into a new one (taken straight from the bitmap, we really don't want to try reclaiming memory
+     * here), and remap the virtual address that was using it. We have no SMP yet, so nobody can touch the page while
+     * we're doing this. */
 
-                    for (cj = i + 1; cj < ci; cj++) {
-                        Regions[cj].Free = 0;
-                        Regions[cj].Used = PHYS_REGION_BITMAP_PSIZE;
-                        SetMemory(Regions[cj].Pages, 0xFF, sizeof(Regions[cj].Pages));
-                    }
+    UIntPtr virt = Frames[Index].Mapping, phys, page;
+    UInt32 flags;
+    Status status;
+    Void *dst;
 
-                    UsedBytes += Count << PAGE_SHIFT;
+    if (VirtMem::Query(virt, phys, flags) != Status::Success || TakePages(1, &page) != 1) return Status::OutOfMemory;
+    else if ((dst = VirtMem::MapTemp(page)) == Null) return ReleasePages(&page, 1), Status::OutOfMemory;
 
-                    return Status::Success;
-                }
-            }
-        }
-    }
+    CopyMemory(dst, reinterpret_cast<Void*>(virt), PAGE_SIZE);
+    VirtMem::UnmapTemp();
 
-    return Status::OutOfMemory;
-}
+    flags &= ~MAP_HUGE;
 
-Status PhysMem::FreeInt(UIntPtr Start, UIntPtr Count) {
-    if (!Start || !Count || UsedBytes < (Count << PAGE_SHIFT) || (Start & PAGE_MASK) || Start < MinAddress ||
-        Start + (Count << PAGE_SHIFT) > MaxAddress) {
-        Debug.SetForeground(0xFFFF0000);
-        Debug.Write("invalid PhysMem::FreeInt arguments (start = 0x{:0*:16}, count = {})\n",
-                    Start, Count);
-        Debug.RestoreForeground();
-        return Status::InvalidArg;
+    /* Unmapping may need to demote a huge page (which needs memory for the new table), so this can fail. This is only
+     * best effort, so if anything goes wrong, put the old mapping back (if it is already there, Map just fails), and
+     * let the caller skip this page. */
+
+    if ((status = VirtMem::Unmap(virt, PAGE_SIZE)) != Status::Success ||
+        (status = VirtMem::Map(virt, page, PAGE_SIZE, flags)) != Status::Success) {
+        VirtMem::Map(virt, phys, PAGE_SIZE, flags);
+        ReleasePages(&page, 1);
+        return status;
     }
 
-    Start -= MinAddress;
+    /* The new page inherits the reference (and the mapping), and the old one is now unused (but still marked as used on
+     * the bitmap, the caller is going to do something with it). */
 
-    while (Count) {
-        /* Save the indexes of this page into the region bitmap. */
-    
-        UIntPtr i = Start >> PHYS_REGION_SHIFT, j = (Start >> PHYS_REGION_PAGE_SHIFT) & (PHYS_REGION_BITMAP_LEN - 1),
-                k = (Start >> PAGE_SHIFT) & (PHYS_REGION_BITMAP_PSIZE - 1);
+    Frame &frm = Frames[(page - MinAddress) >> PAGE_SHIFT];
 
-        /* Now check if we can just free a whole bitmap or region (those cases are easier to handle). */
+    frm.Mapping = virt;
+    frm.Flags |= FRAME_MOVABLE;
+    __atomic_store_n(&frm.References, 1, __ATOMIC_RELEASE);
+
+    Frames[Index].Flags &= ~FRAME_MOVABLE;
+    __atomic_store_n(&Frames[Index].References, 0, __ATOMIC_RELEASE);
+
+    MigratedPages++;
+
+    return Status::Success;
+}
+
+Status PhysMem::Compact(UIntPtr Count, UIntPtr &Out, UIntPtr Align) {
+    /* Called when we couldn't find enough consecutive pages, even though there is enough free memory: Try to build a
+     * naturally aligned block big enough for the request, by moving the used pages that are inside of it somewhere
+     * else (all of them need to be movable). We only do this for blocks up to the huge page size (moving more than that
+     * isn't worth it), start where the last call stopped, and give up after going through all the blocks, or after
+     * PHYS_COMPACT_BUDGET TSC cycles. */
+
+    UIntPtr size = 1, pages = (ReadyAddress - MinAddress) >> PAGE_SHIFT, base = MinAddress >> PAGE_SHIFT;
+
+    while (size <= BitOp::GetBit(PHYS_HUGE_ORDER) && (size < Count || (size << PAGE_SHIFT) < Align)) size <<= 1;
+
+    if (Frames == Null || size > BitOp::GetBit(PHYS_HUGE_ORDER) || MaxBytes - UsedBytes < (size << PAGE_SHIFT)) {
+        return Status::OutOfMemory;
+    }
+
+    UIntPtr first = (size - (base & (size - 1))) & (size - 1), blocks = pages > first ? (pages - first) / size : 0;
+    UInt64 start = Arch::GetTimestamp();
+
+    for (UIntPtr n = 0; n < blocks && Arch::GetTimestamp() - start < PHYS_COMPACT_BUDGET; n++) {
+        UIntPtr idx = first + ((CompactCursor + n) % blocks) * size, end = idx + size, p = idx;
+
+        for (; p < end && (!CheckPages(p << PAGE_SHIFT, 1, True) || IsMovable(p)); p++) ;
+        if (p < end) continue;
+
+        CompactCursor = (CompactCursor + n + 1) % blocks;
+
+        /* Take all the free pages of the block first (so that the new pages can't come from inside of it), and then
+         * move everything that is still referenced. */
+
+        for (p = idx; p < end;) {
+            UIntPtr len = 0;
+
+            for (; p + len < end && CheckPages((p + len) << PAGE_SHIFT, 1, False); len++) ;
+
+            if (!len) {
+                p++;
+                continue;
+            }
+
+            MarkPages(p << PAGE_SHIFT, len, True);
+            CarveRange(p, len);
+            p += len;
+        }
+
+        Status status = Status::Success;
+
+        for (p = idx; p < end && status == Status::Success; p++) {
+            if (ReadReferences(p)) status = MigratePage(p);
+        }
+
+        if (status != Status::Success) {
+            /* Out of memory, or we couldn't remap some page (the page stays where it was), give back everything that
+             * isn't referenced anymore (the pages that were already free, and the ones that we already moved). Only
+             * running out of memory stops us, else, we can still try the other blocks. */
+
+            for (p = idx; p < end; p++) {
+                if (!ReadReferences(p)) FreeInt(MinAddress + (p << PAGE_SHIFT), 1);
+            }
+
+            if (status == Status::OutOfMemory) return status;
 
-        if (!j && !k && Count >= PHYS_REGION_PSIZE && !Regions[i].Free) {
-            Regions[i].Free = PHYS_REGION_PSIZE;
-            Regions[i].Used = 0;
-            UsedBytes -= PHYS_REGION_BSIZE;
-            Start += PHYS_REGION_BSIZE;
-            Count -= PHYS_REGION_PSIZE;
-            SetMemory(Regions[i].Pages, 0, sizeof(Regions[i].Pages));
             continue;
-        } else if (!k && Count >= PHYS_REGION_BITMAP_PSIZE && Regions[i].Used >= PHYS_REGION_BITMAP_PSIZE) {
-            Regions[i].Free += PHYS_REGION_BITMAP_PSIZE;
-            Regions[i].Used -= PHYS_REGION_BITMAP_PSIZE;
-            Regions[i].Pages[j] = 0;
-            UsedBytes -= PHYS_REGION_BITMAP_BSIZE;
-            Start += PHYS_REGION_BITMAP_BSIZE;
-            Count -= PHYS_REGION_BITMAP_PSIZE;
+        }
+
+        if (size > Count) FreeInt(MinAddress + ((idx + Count) << PAGE_SHIFT), size - Count);
+
+        Compactions++;
+
+        return Out = MinAddress + (idx << PAGE_SHIFT), Status::Success;
+    }
+
+    return Status::OutOfMemory;
+}
+
+UIntPtr PhysMem::GetHugeFree(UIntPtr Address) {
+    /* Get how many pages of the huge page sized frame containing the address are free (not counting the ones that are
+     * on the per-CPU caches). If the frame is inside a big enough free block, all of them are free, else, we can just
+     * use the counter. */
+
+    if (Frames == Null || Address < MinAddress || Address >= ReadyAddress) return 0;
+
+    UIntPtr base = MinAddress >> PAGE_SHIFT, idx = (Address - MinAddress) >> PAGE_SHIFT;
+
+    for (UIntPtr order = PHYS_HUGE_ORDER; order <= PHYS_MAX_ORDER; order++) {
+        UIntPtr head = (((base + idx) >> order) << order) - base;
+
+        if (head < FrameCount && (Frames[head].Flags & FRAME_FREE) && Frames[head].Order >= order) {
+            return BitOp::GetBit(PHYS_HUGE_ORDER);
+        }
+    }
+
+    return HugeFree[GetHugeIndex(idx)];
+}
+
+Status PhysMem::RefillMagazine(Magazine &Mag) {
+    /* Grab a batch of pages from the global allocator (but not more than what is currently free, so that we don't end
+     * up triggering the reclaim path, which would drain the magazine we're trying to fill). If there is nothing free,
+     * we still try a single page, and let AllocInt try to reclaim some memory. */
+
+    UIntPtr count = (MaxBytes - UsedBytes) >> PAGE_SHIFT, page;
+
+    if (count > PHYS_MAGAZINE_BATCH) count = PHYS_MAGAZINE_BATCH;
+    else if (!count) count = 1;
+
+    for (; Mag.Count < count; Mag.Count++) {
+        if (AllocInt(1, page, PAGE_SIZE) != Status::Success) break;
+        if (Frames != Null) Frames[(page - MinAddress) >> PAGE_SHIFT].Flags |= FRAME_CACHED;
+        Mag.Pages[Mag.Count] = page;
+        CachedBytes += PAGE_SIZE;
+    }
+
+    return Mag.Count ? Status::Success : Status::OutOfMemory;
+}
+
+Void PhysMem::DrainMagazine(Magazine &Mag, UIntPtr Count) {
+    /* Give the oldest pages (the ones on the bottom of the stack) back to the global allocator, and move the rest
+     * down. */
+
+    if (Count > Mag.Count) Count = Mag.Count;
+
+    for (UIntPtr i = 0; i < Count; i++) {
+        if (Frames != Null) Frames[(Mag.Pages[i] - MinAddress) >> PAGE_SHIFT].Flags &= ~FRAME_CACHED;
+        FreeInt(Mag.Pages[i], 1);
+        CachedBytes -= PAGE_SIZE;
+    }
+
+    MoveMemory(Mag.Pages, &Mag.Pages[Count], (Mag.Count - Count) * sizeof(UIntPtr));
+    Mag.Count -= Count;
+}
+
+Void PhysMem::DrainMagazines() {
+    for (Magazine &mag : Magazines) DrainMagazine(mag, mag.Count);
+}
+
+Void PhysMem::RefillZeroPool() {
+    /* This should be called when the CPU has nothing better to do: Take a batch of pages straight from the bitmap (but
+     * only what is actually free, as this is never worth reclaiming memory), and zero them (using non-temporal
+     * stores, so that we don't throw away whatever is on the cache right now). The pages stay marked as used on the
+     * bitmap, but they are accounted as free (same as the magazines). */
+
+    UIntPtr count = PHYS_ZERO_POOL_SIZE - ZeroCount, avail = (MaxBytes - UsedBytes) >> PAGE_SHIFT;
+
+    if (!Initialized || !count || !avail) return;
+    else if (count > avail) count = avail;
+
+    for (UIntPtr i = 0, got = TakePages(count, &ZeroPool[ZeroCount]); i < got; i++) {
+        UIntPtr page = ZeroPool[ZeroCount];
+
+        if (ZeroPage(page) != Status::Success) {
+            /* We can't map the pages yet (VirtMem isn't initialized), put back everything that we haven't zeroed. */
+
+            Sort(&ZeroPool[ZeroCount], &ZeroPool[ZeroCount + got - i], [](UIntPtr A, UIntPtr B) { return A < B; });
+            ReleasePages(&ZeroPool[ZeroCount], got - i);
+
+            return;
+        }
+
+        if (Frames != Null) Frames[(page - MinAddress) >> PAGE_SHIFT].Flags |= FRAME_CACHED;
+
+        ZeroCount++;
+        CachedBytes += PAGE_SIZE;
+    }
+}
+
+Void PhysMem::DrainZeroPool() {
+    /* Give all the zeroed pages back to the bitmap (we're probably running out of memory, so the time we spent zeroing
+     * them is going to be wasted). */
+
+    if (!ZeroCount) return;
+
+    for (UIntPtr i = 0; i < ZeroCount; i++) {
+        if (Frames != Null) Frames[(ZeroPool[i] - MinAddress) >> PAGE_SHIFT].Flags &= ~FRAME_CACHED;
+    }
+
+    Sort(ZeroPool, &ZeroPool[ZeroCount], [](UIntPtr A, UIntPtr B) { return A < B; });
+    ReleasePages(ZeroPool, ZeroCount);
+
+    CachedBytes -= ZeroCount << PAGE_SHIFT;
+    ZeroCount = 0;
+}
+
+Status PhysMem::ZeroPage(UIntPtr Page) {
+    /* We have no direct map of the physical memory, so we need to temporarily map the page before clearing it. */
+
+    auto dst = static_cast<UInt8*>(VirtMem::MapTemp(Page));
+
+    if (dst == Null) return Status::NotMapped;
+
+#ifdef NO_256_SIMD
+    Int64x2 val = { 0, 0 };
+
+    for (UIntPtr i = 0; i < PAGE_SIZE; i += 64) {
+        SIMD::StoreNonTemporal(dst + i, val), SIMD::StoreNonTemporal(dst + i + 16, val);
+        SIMD::StoreNonTemporal(dst + i + 32, val), SIMD::StoreNonTemporal(dst + i + 48, val);
+    }
+#else
+    Int64x4 val = { 0, 0, 0, 0 };
+
+    for (UIntPtr i = 0; i < PAGE_SIZE; i += 128) {
+        SIMD::StoreNonTemporal(dst + i, val), SIMD::StoreNonTemporal(dst + i + 32, val);
+        SIMD::StoreNonTemporal(dst + i + 64, val), SIMD::StoreNonTemporal(dst + i + 96, val);
+    }
+#endif
+
+    /* Non-temporal stores are weakly ordered, so we need a fence before anyone else gets to use the page. */
+
+    SIMD::StoreFence();
+    VirtMem::UnmapTemp();
+
+    return Status::Success;
+}
+
+UIntPtr PhysMem::TakePages(UIntPtr Count, UIntPtr *Out) {
+    /* Take up to Count free pages from the bitmap, grabbing all the free bits of each bitmap word that we visit (instead
+     * of restarting the search for each page). Returns how many pages we actually got. */
+
+    UIntPtr done = 0, first = (Zones[LocalNode].First << PAGE_SHIFT) >> PHYS_REGION_SHIFT, end = RegionCount;
+
+    /* Start at the first region of the local node, and wrap around after reaching the end. */
+
+    for (UIntPtr i = FindRegion(first); done < Count; i = FindRegion(i + 1)) {
+        if (i >= end) {
+            if (end != RegionCount || !first || (i = FindRegion(0)) >= first) break;
+            end = first;
+        }
+
+        for (UIntPtr j : BitOp::IteratorWrapper(Regions[i].Summary)) {
+            UIntPtr start = (i << PHYS_REGION_SHIFT) + (j << PHYS_REGION_PAGE_SHIFT), map = ~Regions[i].Pages[j],
+                    taken = 0;
+
+            for (; map && done < Count; map &= map - 1) {
+                UIntPtr k = BitOp::ScanForward(map);
+                taken |= BitOp::GetBit(k);
+                Out[done++] = MinAddress + start + (k << PAGE_SHIFT);
+            }
+
+            UIntPtr cnt = BitOp::Count(taken);
+
+            Regions[i].Pages[j] |= taken;
+            Regions[i].Free -= cnt;
+            UsedBytes += cnt << PAGE_SHIFT;
+
+            if (Regions[i].Pages[j] == UINTPTR_MAX) Regions[i].Summary &= ~BitOp::GetBit(j);
+
+            /* The buddy lists still have those pages as free, remove them (one run of consecutive pages at a
+             * time). */
+
+            while (Frames != Null && taken) {
+                UIntPtr k = BitOp::ScanForward(taken), len = BitOp::ScanForward(~(taken >> k));
+                CarveRange((start >> PAGE_SHIFT) + k, len);
+                taken &= ~BitOp::GetMask(k, k + len - 1);
+            }
+
+            if (done == Count) break;
+        }
+
+        if (!Regions[i].Free) UpdateSummary(i);
+    }
+
+    return done;
+}
+
+Void PhysMem::ReleasePages(UIntPtr *Pages, UIntPtr Count) {
+    /* Give back a sorted (and already validated) list of pages to the bitmap, clearing all the pages that are on the
+     * same bitmap word using a single operation. */
+
+    for (UIntPtr n = 0; n < Count;) {
+        UIntPtr start = Pages[n] - MinAddress, word = start >> PHYS_REGION_PAGE_SHIFT, i = start >> PHYS_REGION_SHIFT,
+                j = word & (PHYS_REGION_BITMAP_LEN - 1), mask = 0;
+
+        for (; n < Count && ((Pages[n] - MinAddress) >> PHYS_REGION_PAGE_SHIFT) == word; n++) {
+            mask |= BitOp::GetBit(((Pages[n] - MinAddress) >> PAGE_SHIFT) & (PHYS_REGION_BITMAP_PSIZE - 1));
+        }
+
+        UIntPtr cnt = BitOp::Count(mask);
+
+        Regions[i].Pages[j] &= ~mask;
+        Regions[i].Free += cnt;
+        Regions[i].Summary |= BitOp::GetBit(j);
+        UsedBytes -= cnt << PAGE_SHIFT;
+
+        if (Regions[i].Free == cnt) UpdateSummary(i);
+
+        /* And put the pages back into the buddy lists (again, one run at a time, so that they can be merged). */
+
+        start = (word << PHYS_REGION_PAGE_SHIFT) >> PAGE_SHIFT;
+
+        while (Frames != Null && mask) {
+            UIntPtr k = BitOp::ScanForward(mask), len = BitOp::ScanForward(~(mask >> k));
+            InsertRange(start + k, len);
+            mask &= ~BitOp::GetMask(k, k + len - 1);
+        }
+    }
+}
+
+Void PhysMem::InitializeDeferred(UIntPtr Count) {
+    /* Initialize the next Count regions (or all of the remaining ones): set all the entries on the region list to be
+     * already used, all the entries on the references list to have 0 references, and free the parts of the saved free
+     * ranges that are inside the new regions. As the regions are always initialized in order, everything below
+     * ReadyAddress is ready to be used. */
+
+    if (Regions == Null || ReadyCount >= RegionCount) return;
+    else if (!Count) Count = PHYS_DEFER_BATCH;
+
+    if (Count > RegionCount - ReadyCount) Count = RegionCount - ReadyCount;
+
+    UIntPtr pages = (MaxAddress - MinAddress) >> PAGE_SHIFT, start = ReadyAddress;
+
+    for (UIntPtr i = ReadyCount; i < ReadyCount + Count; i++) {
+        UIntPtr first = i * PHYS_REGION_PSIZE;
+
+        Regions[i].Free = 0;
+        Regions[i].Summary = 0;
+        SetMemory(Regions[i].Pages, 0xFF, sizeof(Regions[i].Pages));
+
+        if (first < pages) {
+            SetMemory(&References[first], 0, pages - first < PHYS_REGION_PSIZE ? pages - first : PHYS_REGION_PSIZE);
+        }
+    }
+
+    ReadyCount += Count;
+    ReadyAddress = ReadyCount >= RegionCount ? MaxAddress : MinAddress + (ReadyCount << PHYS_REGION_SHIFT);
+
+    for (UIntPtr i = 0; i < DeferredCount; i++) {
+        UIntPtr low = DeferredRanges[i].Start > start ? DeferredRanges[i].Start : start,
+                high = DeferredRanges[i].End < ReadyAddress ? DeferredRanges[i].End : ReadyAddress;
+
+        if (low >= high) continue;
+
+        FreeInt(low, (high - low) >> PAGE_SHIFT);
+        DeferredBytes -= high - low;
+    }
+
+    /* Whatever is left (ranges outside of the physical address space that we manage) is never going to be freed. */
+
+    if (ReadyCount >= RegionCount) {
+        DeferredBytes = DeferredCount = 0;
+        Debug.Write("all the physical memory regions have been initialized\n");
+    }
+}
+
+Void PhysMem::DeferRange(UIntPtr Start, UIntPtr Count) {
+    /* Save one free range of the memory map, merging it with the last one if possible (the memory map is usually
+     * sorted, and it may have multiple consecutive free entries). Anything that is below ReadyAddress can be freed
+     * right away, and if we run out of space for saving the range, we just initialize everything up to its end. */
+
+    UIntPtr end = Start + (Count << PAGE_SHIFT);
+
+    if (ReadyCount && Start < ReadyAddress) {
+        UIntPtr cnt = ((end < ReadyAddress ? end : ReadyAddress) - Start) >> PAGE_SHIFT;
+
+        FreeInt(Start, cnt);
+
+        if (!(Count -= cnt)) return;
+        Start += cnt << PAGE_SHIFT;
+    }
+
+    if (DeferredCount && DeferredRanges[DeferredCount - 1].End == Start) {
+        DeferredRanges[DeferredCount - 1].End = end;
+    } else if (DeferredCount < PHYS_MAX_DEFERRED_RANGES) {
+        DeferredRanges[DeferredCount++] = { Start, end };
+    } else {
+        while (ReadyCount < RegionCount && ReadyAddress < end) InitializeDeferred(ReadyCount);
+        FreeInt(Start, Count);
+        return;
+    }
+
+    DeferredBytes += Count << PAGE_SHIFT;
+}
+
+Void PhysMem::AddNodeRange(UIntPtr Start, UIntPtr Size, UInt8 Node) {
+    /* This should be called by Acpi::Initialize (while parsing the SRAT), before FinishInitialization. */
+
+    if (Frames != Null || !Size || Node >= PHYS_MAX_NODES || NodeRangeCount >= PHYS_MAX_NODE_RANGES ||
+        Start >= MaxAddress || Start + Size <= MinAddress) {
+        Debug.SetForeground(0xFFFFFF00);
+        Debug.Write("ignoring the NUMA memory range 0x{:0*:16}-0x{:0*:16} (node {})\n", Start, Start + Size, Node);
+        Debug.RestoreForeground();
+        return;
+    }
+
+    NodeRanges[NodeRangeCount++] = { Start & ~PAGE_MASK, (Start + Size) & ~PAGE_MASK, Node };
+    if (Node >= NodeCount) NodeCount = Node + 1;
+}
+
+Void PhysMem::SetLocalNode(UInt8 Node) {
+    /* We have no SMP yet, so there is only one local node (the one from the boot processor), once we have it, this
+     * should be per-CPU data (just like the magazines). */
+
+    if (Node < PHYS_MAX_NODES) LocalNode = Node;
+    if (Node >= NodeCount) NodeCount = Node + 1;
+}
+
+UIntPtr PhysMem::GetNodeEnd(UIntPtr Index) {
+    /* Find where the node of the given frame ends (that is, the first frame after it that is on another node), so
+     * that InsertRange never creates blocks crossing into other nodes. The boundaries are sorted, so we can just binary
+     * search them. */
+
+    UIntPtr low = 0, high = NodeBoundCount;
+
+    while (low < high) {
+        UIntPtr mid = (low + high) / 2;
+        if (NodeBounds[mid] <= Index) low = mid + 1;
+        else high = mid;
+    }
+
+    return low < NodeBoundCount ? NodeBounds[low] : FrameCount;
+}
+
+Void PhysMem::PushBlock(UIntPtr Index, UInt8 Order) {
+    /* Put the block at the start of the free list of its order (no merging here, the caller should make sure that
+     * the buddy of this block isn't free, or use InsertBlock instead). */
+
+    Frame &frm = Frames[Index];
+    Zone &zone = Zones[frm.Node];
+
+    frm.Order = Order;
+    frm.Flags |= FRAME_FREE;
+    frm.Prev = FRAME_NONE;
+    frm.Next = zone.FreeLists[Order];
+
+    if (frm.Next != FRAME_NONE) Frames[frm.Next].Prev = Index;
+    if (Order < PHYS_HUGE_ORDER) HugeFree[GetHugeIndex(Index)] += BitOp::GetBit(Order);
+
+    zone.FreeLists[Order] = Index;
+    zone.FreeMask |= BitOp::GetBit(Order);
+    zone.Free += BitOp::GetBit(Order);
+}
+
+Void PhysMem::RemoveBlock(UIntPtr Index) {
+    /* And here we unlink the block from its free list, clearing the bit on the free mask if that list is now
+     * empty. */
+
+    Frame &frm = Frames[Index];
+    Zone &zone = Zones[frm.Node];
+
+    if (frm.Prev != FRAME_NONE) Frames[frm.Prev].Next = frm.Next;
+    else zone.FreeLists[frm.Order] = frm.Next;
+
+    if (frm.Next != FRAME_NONE) Frames[frm.Next].Prev = frm.Prev;
+    if (zone.FreeLists[frm.Order] == FRAME_NONE) zone.FreeMask &= ~BitOp::GetBit(frm.Order);
+    if (frm.Order < PHYS_HUGE_ORDER) HugeFree[GetHugeIndex(Index)] -= BitOp::GetBit(frm.Order);
+
+    zone.Free -= BitOp::GetBit(frm.Order);
+
+    frm.Flags &= ~FRAME_FREE;
+    frm.Next = frm.Prev = FRAME_NONE;
+}
+
+Void PhysMem::InsertBlock(UIntPtr Index, UInt8 Order) {
+    /* Free a naturally aligned block, merging it with its buddy for as long as the buddy is also a free block of the
+     * same order. The buddy is always calculated using the actual page frame number (instead of the index), so that
+     * the blocks are aligned on the physical address space, even if MinAddress isn't. */
+
+    UIntPtr base = MinAddress >> PAGE_SHIFT;
+
+    for (; Order < PHYS_MAX_ORDER; Order++) {
+        UIntPtr buddy = ((base + Index) ^ BitOp::GetBit(Order)) - base;
+
+        if (buddy >= FrameCount || !(Frames[buddy].Flags & FRAME_FREE) || Frames[buddy].Order != Order ||
+            Frames[buddy].Node != Frames[Index].Node) break;
+
+        RemoveBlock(buddy);
+        if (buddy < Index) Index = buddy;
+    }
+
+    PushBlock(Index, Order);
+}
+
+Void PhysMem::InsertRange(UIntPtr Index, UIntPtr Count) {
+    /* Split the range into the biggest naturally aligned blocks that we can (without crossing into another node), and
+     * insert each one of them (merging with anything around it). */
+
+    UIntPtr base = MinAddress >> PAGE_SHIFT, end = GetNodeEnd(Index);
+
+    while (Count) {
+        if (Index >= end) end = GetNodeEnd(Index);
+
+        UIntPtr order = BitOp::ScanForward(base + Index),
+                fit = BitOp::ScanReverse(Count < end - Index ? Count : end - Index);
+
+        if (order > fit) order = fit;
+        if (order > PHYS_MAX_ORDER) order = PHYS_MAX_ORDER;
+
+        InsertBlock(Index, order);
+
+        Index += BitOp::GetBit(order);
+        Count -= BitOp::GetBit(order);
+    }
+}
+
+Void PhysMem::CarveRange(UIntPtr Index, UIntPtr Count) {
+    /* The bitmap fallback of AllocInt may hand out pages that are still inside of some free block, so we need to find
+     * the block containing each page, remove it, and give back the parts that aren't going to be used. */
+
+    UIntPtr base = MinAddress >> PAGE_SHIFT, end = Index + Count;
+
+    while (Index < end) {
+        UIntPtr head = 0, order = 0;
+
+        for (; order <= PHYS_MAX_ORDER; order++) {
+            head = (((base + Index) >> order) << order) - base;
+            if (head < FrameCount && (Frames[head].Flags & FRAME_FREE) && Frames[head].Order >= order) break;
+        }
+
+        ASSERT(order <= PHYS_MAX_ORDER);
+
+        UIntPtr bend = head + BitOp::GetBit(Frames[head].Order);
+
+        RemoveBlock(head);
+
+        if (head < Index) InsertRange(head, Index - head);
+        if (bend > end) InsertRange(end, bend - end), bend = end;
+
+        Index = bend;
+    }
+}
+
+Status PhysMem::AllocBuddy(UIntPtr Count, UIntPtr &Out, UIntPtr Align) {
+    /* The order we need is the minimum order that fits both the amount of pages, and the alignment (as all blocks are
+     * naturally aligned). Using the free mask of each zone, we can find the smallest non-empty free list with a single
+     * bit scan, instead of going through all the lists. We always try the local node first, and only then go to the
+     * other ones. */
+
+    UIntPtr order = Count > 1 ? BitOp::ScanReverse(Count - 1) + 1 : 0,
+            aorder = Align > PAGE_SIZE ? BitOp::ScanReverse(Align - 1) + 1 - PAGE_SHIFT : 0, node = LocalNode;
+
+    if (aorder > order) order = aorder;
+    if (order > PHYS_MAX_ORDER) return Status::OutOfMemory;
+
+    for (UIntPtr i = 1; i < NodeCount && !(Zones[node].FreeMask >> order); i++) {
+        node = node + 1 < NodeCount ? node + 1 : 0;
+    }
+
+    if (!(Zones[node].FreeMask >> order)) return Status::OutOfMemory;
+    else if (node != LocalNode) Zones[LocalNode].Fallbacks++;
+
+    UIntPtr cur = BitOp::ScanForward(Zones[node].FreeMask >> order) + order, idx = Zones[node].FreeLists[cur];
+
+    RemoveBlock(idx);
+
+    /* Split the block until we reach the order that we want (giving back the upper halves), and if we don't need the
+     * whole block (the count wasn't a power of two), give back the tail as well. */
+
+    while (cur > order) {
+        cur--;
+        PushBlock(idx + BitOp::GetBit(cur), cur);
+    }
+
+    if (Count < BitOp::GetBit(order)) InsertRange(idx + Count, BitOp::GetBit(order) - Count);
+
+    return Out = MinAddress + (idx << PAGE_SHIFT), Status::Success;
+}
+
+Void PhysMem::GetStatistics(Statistics &Out) {
+    /* The free run histogram (and the largest free block) is only calculated now, by scanning the bitmap of all the
+     * initialized regions (the pages that are on the per-CPU caches are counted as used), everything else is just a
+     * copy of the counters. */
+
+    Out.LargestRun = ScanFreeRuns(0, ReadyCount, Out.Runs);
+    Out.ContigFailures = ContigFailures;
+    Out.EmergencyReclaims = EmergencyReclaims;
+    Out.ProactiveReclaims = ProactiveReclaims;
+    Out.Compactions = Compactions;
+    Out.MigratedPages = MigratedPages;
+
+    CopyMemory(Out.AllocLatency, AllocLatency, sizeof(AllocLatency));
+    CopyMemory(Out.FreeLatency, FreeLatency, sizeof(FreeLatency));
+}
+
+UIntPtr PhysMem::GetRunHistogram(UIntPtr Region, UIntPtr *Out) {
+    /* Same as above, but only for a single region (the runs that cross into the next/previous regions are cut), the
+     * return value is the largest run. */
+
+    if (Region >= ReadyCount || Out == Null) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid PhysMem::GetRunHistogram arguments (region = {}, out = 0x{:0*:16})\n", Region, Out);
+        Debug.RestoreForeground();
+        return 0;
+    }
+
+    return ScanFreeRuns(Region, Region + 1, Out);
+}
+
+Void PhysMem::PrintStatistics() {
+    Statistics stats;
+
+    GetStatistics(stats);
+
+    Debug.Write("physical memory usage is 0x{:0:16} bytes, 0x{:0:16} bytes are free (0x{:0:16} on the caches, and "
+                "0x{:0:16} on the deferred regions)\n", GetUsage(), GetFree(), CachedBytes, DeferredBytes);
+    Debug.Write("the largest free block has {} pages, {} contig allocations failed, and {} emergency (and {} "
+                "proactive) reclaims were done\n", stats.LargestRun, stats.ContigFailures, stats.EmergencyReclaims,
+                stats.ProactiveReclaims);
+    Debug.Write("{} blocks were recovered by compaction ({} pages were moved)\n", stats.Compactions,
+                stats.MigratedPages);
+
+    PrintHistogram("free runs (pages)", stats.Runs);
+    PrintHistogram("AllocInt latency (cycles)", stats.AllocLatency);
+    PrintHistogram("FreeInt latency (cycles)", stats.FreeLatency);
+}
+
+UIntPtr PhysMem::GetBucket(UInt64 Value) {
+    UIntPtr log = Value < 2 ? 0 : 63 - __builtin_clzll(Value);
+    return log < PHYS_STAT_BUCKETS ? log : PHYS_STAT_BUCKETS - 1;
+}
+
+UIntPtr PhysMem::ScanFreeRuns(UIntPtr First, UIntPtr Last, UIntPtr *Histogram) {
+    /* Go through each bitmap word of the given regions, collecting the runs of free pages (which may cross into the
+     * next words or regions, just like on FinishInitialization). Full words/regions can be skipped without looking at
+     * each bit. */
+
+    UIntPtr run = 0, largest = 0;
+
+    if (Histogram != Null) SetMemory(Histogram, 0, PHYS_STAT_BUCKETS * sizeof(UIntPtr));
+
+    auto flush = [&]() {
+        if (!run) return;
+        if (Histogram != Null) Histogram[GetBucket(run)]++;
+        if (run > largest) largest = run;
+        run = 0;
+    };
+
+    for (UIntPtr i = First; i < Last; i++) {
+        if (!Regions[i].Free) {
+            flush();
             continue;
         }
 
-        /* If none of the above, first do error checking, and free as many pages using a single operation.. */
+        for (UIntPtr j = 0; j < PHYS_REGION_BITMAP_LEN; j++) {
+            UIntPtr map = Regions[i].Pages[j];
+
+            for (UIntPtr k = 0; k < PHYS_REGION_BITMAP_PSIZE;) {
+                UIntPtr rest = map >> k, cnt = rest ? BitOp::ScanForward(rest) : PHYS_REGION_BITMAP_PSIZE - k;
+
+                if (rest & 1) {
+                    flush();
+                    k += BitOp::ScanForward(~rest);
+                    continue;
+                }
+
+                run += cnt;
+                k += cnt;
+            }
+        }
+    }
+
+    return flush(), largest;
+}
+
+Void PhysMem::PrintHistogram(const Char *Name, const UIntPtr *Histogram) {
+    Debug.Write("{}:\n", Name);
+
+    for (UIntPtr i = 0; i < PHYS_STAT_BUCKETS; i++) {
+        if (Histogram[i]) Debug.Write("    [2^{}, 2^{}): {}\n", i, i + 1, Histogram[i]);
+    }
+}
+
+UIntPtr PhysMem::FindRegion(UIntPtr Start) {
+    /* Find the first region that isn't full, starting at the given region. Before FinishInitialization, we have to go
+     * region by region, but afterwards we can use the summary levels. */
+
+    if (RegionSummary == Null) {
+        while (Start < ReadyCount && !Regions[Start].Free) Start++;
+        return Start < ReadyCount ? Start : RegionCount;
+    } else if (Start >= RegionCount) return RegionCount;
+
+    UIntPtr i = Start / PHYS_REGION_BITMAP_PSIZE, k = Start & (PHYS_REGION_BITMAP_PSIZE - 1),
+            map = (RegionSummary[i] >> k) << k;
+
+    if (map) return i * PHYS_REGION_BITMAP_PSIZE + BitOp::ScanForward(map);
 
-        ASSERT(Regions[i].Used);
+    /* Nothing else on this first level word, go to the top level (skipping whole words that are fully used). */
+
+    for (i++; i < SummaryCount; i = (i | (PHYS_REGION_BITMAP_PSIZE - 1)) + 1) {
+        k = i & (PHYS_REGION_BITMAP_PSIZE - 1);
+
+        if ((map = (TopSummary[i / PHYS_REGION_BITMAP_PSIZE] >> k) << k)) {
+            i = (i & ~(PHYS_REGION_BITMAP_PSIZE - 1)) + BitOp::ScanForward(map);
+            return i * PHYS_REGION_BITMAP_PSIZE + BitOp::ScanForward(RegionSummary[i]);
+        }
+    }
+
+    return RegionCount;
+}
+
+Void PhysMem::UpdateSummary(UIntPtr Index) {
+    /* Update the region level summary bit (and the top level bit, if the first level word went from zero to non-zero
+     * or the other way around). */
+
+    if (RegionSummary == Null) return;
+
+    UIntPtr i = Index / PHYS_REGION_BITMAP_PSIZE, old = RegionSummary[i];
+
+    if (Regions[Index].Free) RegionSummary[i] |= BitOp::GetBit(Index & (PHYS_REGION_BITMAP_PSIZE - 1));
+    else RegionSummary[i] &= ~BitOp::GetBit(Index & (PHYS_REGION_BITMAP_PSIZE - 1));
+
+    if (!old == !RegionSummary[i]) return;
+    else if (old) TopSummary[i / PHYS_REGION_BITMAP_PSIZE] &= ~BitOp::GetBit(i & (PHYS_REGION_BITMAP_PSIZE - 1));
+    else TopSummary[i / PHYS_REGION_BITMAP_PSIZE] |= BitOp::GetBit(i & (PHYS_REGION_BITMAP_PSIZE - 1));
+}
+
+Void PhysMem::MarkPages(UIntPtr Start, UIntPtr Count, Boolean Used) {
+    /* Set (or unset) all the bits of the range on the region bitmap, while updating the usage counters. Start here is
+     * relative to MinAddress, and the caller should already have checked (using CheckPages) that all the pages are on
+     * the opposite state. */
+
+    while (Count) {
+        UIntPtr i = Start >> PHYS_REGION_SHIFT, j = (Start >> PHYS_REGION_PAGE_SHIFT) & (PHYS_REGION_BITMAP_LEN - 1),
+                k = (Start >> PAGE_SHIFT) & (PHYS_REGION_BITMAP_PSIZE - 1);
+
+        /* Now check if we can just do a whole region (those cases are easier to handle). */
+
+        if (!j && !k && Count >= PHYS_REGION_PSIZE) {
+            Regions[i].Free = Used ? 0 : PHYS_REGION_PSIZE;
+            Regions[i].Summary = Used ? 0 : BitOp::GetMask(PHYS_REGION_BITMAP_LEN - 1);
+            UsedBytes = Used ? UsedBytes + PHYS_REGION_BSIZE : UsedBytes - PHYS_REGION_BSIZE;
+            Start += PHYS_REGION_BSIZE;
+            Count -= PHYS_REGION_PSIZE;
+            SetMemory(Regions[i].Pages, Used ? 0xFF : 0, sizeof(Regions[i].Pages));
+            UpdateSummary(i);
+            continue;
+        }
+
+        /* If not, set/unset as many pages as we can using a single operation (at most, the rest of this bitmap
+         * word). */
 
         UIntPtr end = Count >= PHYS_REGION_BITMAP_PSIZE - k ? (PHYS_REGION_BITMAP_PSIZE - 1)
                                                             : k + Count - 1, cnt = end - k + 1;
 
-        Regions[i].Pages[j] &= ~BitOp::GetMask(k, end);
-        Regions[i].Free += cnt;
-        Regions[i].Used -= cnt;
-        UsedBytes -= PAGE_SIZE * cnt;
-        Start += PAGE_SIZE * cnt;
+        if (Used) {
+            Regions[i].Pages[j] |= BitOp::GetMask(k, end);
+            Regions[i].Free -= cnt;
+            UsedBytes += cnt << PAGE_SHIFT;
+        } else {
+            Regions[i].Pages[j] &= ~BitOp::GetMask(k, end);
+            Regions[i].Free += cnt;
+            UsedBytes -= cnt << PAGE_SHIFT;
+        }
+
+        /* Update the summary bit of this word, and the region level summary if the region became full/not full. */
+
+        if (Regions[i].Pages[j] == UINTPTR_MAX) Regions[i].Summary &= ~BitOp::GetBit(j);
+        else Regions[i].Summary |= BitOp::GetBit(j);
+
+        if (Regions[i].Free == (Used ? 0 : cnt)) UpdateSummary(i);
+
+        Start += cnt << PAGE_SHIFT;
+        Count -= cnt;
+    }
+}
+
+Boolean PhysMem::CheckPages(UIntPtr Start, UIntPtr Count, Boolean Used) {
+    /* Check if all the pages on the range are on the expected state (used or free), again, one bitmap word at a
+     * time. */
+
+    while (Count) {
+        UIntPtr i = Start >> PHYS_REGION_SHIFT, j = (Start >> PHYS_REGION_PAGE_SHIFT) & (PHYS_REGION_BITMAP_LEN - 1),
+                k = (Start >> PAGE_SHIFT) & (PHYS_REGION_BITMAP_PSIZE - 1),
+                end = Count >= PHYS_REGION_BITMAP_PSIZE - k ? (PHYS_REGION_BITMAP_PSIZE - 1) : k + Count - 1,
+                cnt = end - k + 1, mask = BitOp::GetMask(k, end);
+
+        if ((Regions[i].Pages[j] & mask) != (Used ? mask : 0)) return False;
+
+        Start += cnt << PAGE_SHIFT;
         Count -= cnt;
     }
 
+    return True;
+}
+
+Status PhysMem::FindFreePages(UIntPtr BitMap, UIntPtr Count, UIntPtr &Out, UIntPtr &Available) {
+    /* Each unset bit is one free page, for finding consecutive free pages, we can iterate through the bits of the
+     * bitmap and search for free bits. */
+
+    for (UIntPtr bc = PHYS_REGION_BITMAP_PSIZE, i = 0; i < bc;) {
+        if (BitMap == UINTPTR_MAX) return Status::OutOfMemory;
+        else if (!BitMap) {
+            Out = i;
+            Available = bc - i >= Count ? 0 : bc - i;
+            return Available ? Status::OutOfMemory : Status::Success;
+        }
+
+        /* Well, we need to check how many unset bits we have, first, get the location of the first unset bit here,
+         * after that, count how many available bits we have. */
+
+        UIntPtr bit = BitOp::ScanForward(~BitMap);
+
+        if (bit >= bc - i) return Status::OutOfMemory;
+
+        /* Remember that the bits that we shifted in are also zero (but they aren't free pages), so we need to limit
+         * the available count to the end of the bitmap. */
+
+        UIntPtr aval = BitOp::ScanForward(BitOp::GetBits(BitMap, bit, bc - i - 1));
+
+        if (aval > bc - i - bit) aval = bc - i - bit;
+
+        if (aval >= Count) {
+            Out = i + bit;
+            return Status::Success;
+        } else if (i + bit + aval == bc) {
+            /* There might be enough pages, but we need to cross into the next bitmap, let's set Out so that AllocInt
+             * knows that. */
+
+            Out = i + bit;
+            Available = aval;
+
+            return Status::OutOfMemory;
+        }
+
+        BitMap >>= bit + aval;
+        i += bit + aval;
+    }
+
+    return Status::OutOfMemory;
+}
+
+Status PhysMem::AllocPages(UIntPtr Count, UIntPtr &Out, UIntPtr Align) {
+    /* We need to check if all of the arguments are valid, and if the physical memory manager have already been
+     * initialized. */
+
+    if (!Count || !Align) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid PhysMem::AllocInt arguments (count = {}, align = {})\n", Count, Align);
+        Debug.RestoreForeground();
+        return Status::InvalidArg;
+    }
+
+    /* The memory on the regions that we haven't initialized yet was free all along, so initialize them (doubling the
+     * amount of initialized regions each time) before trying to reclaim anything. */
+
+    while (Regions != Null && ReadyCount < RegionCount && UsedBytes + (Count << PAGE_SHIFT) > MaxBytes) {
+        InitializeDeferred(ReadyCount);
+    }
+
+    if (Regions == Null || UsedBytes + (Count << PAGE_SHIFT) > MaxBytes) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("not enough free memory for PhysMem::AllocInt (count = {})\n", Count);
+
+        /* The shrinkers usually free the pages through FreeSingle, so we need to drain the magazines after calling
+         * them. */
+
+        if (Regions != Null && (EmergencyReclaims++,
+                                Shrink(Count - ((MaxBytes - UsedBytes) >> PAGE_SHIFT)), DrainMagazines(),
+                                DrainZeroPool(), UsedBytes + (Count << PAGE_SHIFT) <= MaxBytes)) {
+            Debug.Write("enough memory seems to have been freed through the shrinkers and the page caches\n");
+            Debug.RestoreForeground();
+        } else {
+            Debug.RestoreForeground();
+            return Status::OutOfMemory;
+        }
+    }
+
+    Align -= 1;
+
+    /* Once the buddy allocator is up, it should be able to handle pretty much every request in O(log n), the only
+     * exceptions are when we need more than 2^PHYS_MAX_ORDER pages, or when there is no naturally aligned block big
+     * enough (but there still are enough consecutive free pages around). For those, we fallback to the bitmap. */
+
+    if (Frames != Null && AllocBuddy(Count, Out, Align + 1) == Status::Success) {
+        MarkPages(Out - MinAddress, Count, True);
+        return Status::Success;
+    } else if (Frames != Null && Count <= BitOp::GetBit(PHYS_MAX_ORDER) && !(Count & (Count - 1)) &&
+               Align + 1 >= (Count << PAGE_SHIFT)) {
+        /* When asking for a power of two sized and naturally aligned block (like huge pages), the buddy allocator is
+         * exact, so there is no point in scanning the bitmap. The best that we can do is giving back the pages that
+         * are sitting on the per-CPU caches (as they may be the only thing stopping some block from merging), or
+         * initializing more regions. */
+
+        if (ReadyCount < RegionCount) return InitializeDeferred(ReadyCount), AllocPages(Count, Out, Align + 1);
+        else if (!CachedBytes) return Compact(Count, Out, Align + 1);
+
+        DrainMagazines();
+        DrainZeroPool();
+
+        if (AllocBuddy(Count, Out, Align + 1) != Status::Success) return Compact(Count, Out, Align + 1);
+
+        MarkPages(Out - MinAddress, Count, True);
+
+        return Status::Success;
+    }
+
+    /* Now, we can just go through each non-full region, and each non-full bitmap in each region (using the summary
+     * bitmaps), and try to find the consecutive free pages that we were asked for. */
+
+    for (UIntPtr i = FindRegion(0); i < RegionCount; i = FindRegion(i + 1)) {
+        for (UIntPtr j : BitOp::IteratorWrapper(Regions[i].Summary)) {
+            UIntPtr bit = 0, aval = 0;
+
+            if (FindFreePages(Regions[i].Pages[j], Count, bit, aval) == Status::Success &&
+                !((Out = MinAddress + (i << PHYS_REGION_SHIFT) + (j << PHYS_REGION_PAGE_SHIFT) + (bit << PAGE_SHIFT))
+                       & Align)) {
+                /* Oh, we actually found enough free pages! we need to set all the bits that we're going to use (and
+                 * remove them from the buddy free lists, if required). */
+
+                MarkPages(Out - MinAddress, Count, True);
+                if (Frames != Null) CarveRange((Out - MinAddress) >> PAGE_SHIFT, Count);
+
+                return Status::Success;
+            } else if (aval && !((Out = MinAddress + (i << PHYS_REGION_SHIFT) + (j << PHYS_REGION_PAGE_SHIFT) +
+                                                     (bit << PAGE_SHIFT)) & Align)) {
+                /* Differently from the normal error/out of memory in this region, if the output wasn't null it means
+                 * that we should try crossing into the next region/bitmap. */
+
+                UIntPtr ci = i, cj = j, cur = aval;
+
+                while (True) {
+                    UIntPtr cbit = 0, caval = 0;
+                
+                    if (++cj >= PHYS_REGION_BITMAP_LEN) {
+                        if (++ci >= ReadyCount) break;
+                        cj = 0;
+                    }
+
+                    if ((FindFreePages(Regions[ci].Pages[cj], Count - cur, cbit, caval) != Status::Success &&
+                        caval != PHYS_REGION_BITMAP_PSIZE) || cbit) {
+                        break;
+                    } else if (caval) {
+                        cur += caval;
+                        continue;
+                    }
+
+                    /* Finally, we know that we have enough free physical memory (though it is going through multiple
+                     * region bitmaps lol)! MarkPages already handles crossing into other bitmaps/regions. */
+
+                    MarkPages(Out - MinAddress, Count, True);
+                    if (Frames != Null) CarveRange((Out - MinAddress) >> PAGE_SHIFT, Count);
+
+                    return Status::Success;
+                }
+            }
+        }
+    }
+
+    /* There may be enough consecutive free pages on the regions that we haven't initialized yet. */
+
+    if (ReadyCount < RegionCount) return InitializeDeferred(ReadyCount), AllocPages(Count, Out, Align + 1);
+
+    /* Last chance: the free pages might just be scattered around, try moving some of the used ones. */
+
+    return Count > 1 ? Compact(Count, Out, Align + 1) : Status::OutOfMemory;
+}
+
+Status PhysMem::AllocInt(UIntPtr Count, UIntPtr &Out, UIntPtr Align) {
+    /* AllocPages does all the work, we just need to measure how long it took (including the failures). */
+
+    UInt64 time = Arch::GetTimestamp();
+    Status status = AllocPages(Count, Out, Align);
+
+    AllocLatency[GetBucket(Arch::GetTimestamp() - time)]++;
+
+    /* Waiting until we are completely out of memory to call the shrinkers makes that one allocation really slow (and
+     * it's usually in some bad place, like a page fault), so start asking for memory back once we get below the low
+     * watermark (and try getting back to twice it). If a pass can't even get us back above the low watermark, the
+     * shrinkers don't have much to give back, so don't try again (on every allocation) until the free memory goes
+     * above twice the low watermark again. */
+
+    UIntPtr low = MaxBytes >> PHYS_WATERMARK_SHIFT, free;
+
+    if (status != Status::Success || !ShrinkerCount || Shrinking) return status;
+    else if ((free = GetFree()) >= low << 1) ReclaimBackoff = False;
+    else if (free < low && !ReclaimBackoff) {
+        if (Shrink(((low << 1) - free) >> PAGE_SHIFT)) ProactiveReclaims++;
+        ReclaimBackoff = GetFree() < low;
+    }
+
+    return status;
+}
+
+Status PhysMem::FreeInt(UIntPtr Start, UIntPtr Count) {
+    /* Besides the basic range checks, we also need to make sure that all the pages are actually in use (freeing
+     * something twice would corrupt the buddy free lists). */
+
+    UInt64 time = Arch::GetTimestamp();
+
+    if (!Start || !Count || UsedBytes < (Count << PAGE_SHIFT) || (Start & PAGE_MASK) || Start < MinAddress ||
+        Start + (Count << PAGE_SHIFT) > ReadyAddress || !CheckPages(Start - MinAddress, Count, True)) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid PhysMem::FreeInt arguments (start = 0x{:0*:16}, count = {})\n",
+                    Start, Count);
+        Debug.RestoreForeground();
+        return Status::InvalidArg;
+    }
+
+    MarkPages(Start - MinAddress, Count, False);
+    if (Frames != Null) InsertRange((Start - MinAddress) >> PAGE_SHIFT, Count);
+
+    FreeLatency[GetBucket(Arch::GetTimestamp() - time)]++;
+
     return Status::Success;
 }
@@ -0,0 +1,190 @@
+/* File author is Ítalo Lima Marconato Matias
+ *
+ * Created on October 17 of 2026, at 23:40 BRT
+ * Last edited on October 17 of 2026, at 23:40 BRT */
+
+#include <sys/mm.hxx>
+#include <util/algo.hxx>
+#include <util/stacktrace.hxx>
+
+using namespace CHicago;
+
+ProfileSite Heap::ProfileSites[HEAP_PROFILE_SITES];
+ProfileSample Heap::ProfileSamples[HEAP_PROFILE_SAMPLES];
+UInt16 Heap::ProfileBuckets[HEAP_PROFILE_BUCKETS], Heap::ProfileFree = HEAP_PROFILE_NONE;
+UInt64 Heap::ProfileSeed = 0;
+UIntPtr Heap::ProfileRate = 0, Heap::ProfileCountdown = UINTPTR_MAX, Heap::ProfileLive = 0, Heap::ProfileSiteCount = 0,
+        Heap::ProfileDropped = 0;
+
+static inline UIntPtr GetBucket(Void *Address) {
+    auto addr = reinterpret_cast<UIntPtr>(Address);
+    return ((addr >> 4) ^ (addr >> 12)) & (HEAP_PROFILE_BUCKETS - 1);
+}
+
+Void Heap::StartProfile(UIntPtr Rate) {
+    /* Starting the profiler always throws away whatever we had from the last time (including the samples that are
+     * still alive). */
+
+    if (!Rate) {
+        Debug.SetForeground(0xFFFF0000);
+        Debug.Write("invalid Heap::StartProfile arguments (rate = {})\n", Rate);
+        Debug.RestoreForeground();
+        return;
+    }
+
+    SetMemory(ProfileSites, 0, sizeof(ProfileSites));
+    SetMemory(ProfileBuckets, 0xFF, sizeof(ProfileBuckets));
+
+    for (UIntPtr i = 0; i < HEAP_PROFILE_SAMPLES; i++) {
+        ProfileSamples[i].Next = i + 1 < HEAP_PROFILE_SAMPLES ? i + 1 : HEAP_PROFILE_NONE;
+    }
+
+    ProfileFree = 0;
+    ProfileLive = ProfileSiteCount = ProfileDropped = 0;
+    ProfileSeed = Arch::GetTimestamp() | 1;
+    ProfileRate = Rate;
+    ProfileCountdown = NextSample();
+}
+
+Void Heap::StopProfile() {
+    /* Stop taking new samples, but keep what we have (and keep removing the samples as they are freed), so that the
+     * profile can still be dumped. */
+
+    ProfileRate = 0;
+    ProfileCountdown = UINTPTR_MAX;
+}
+
+UIntPtr Heap::NextSample() {
+    /* Instead of sampling exactly every ProfileRate bytes (which could keep hitting/missing the same allocation in
+     * a loop), take a random distance between half and one and a half times the rate (using xorshift). */
+
+    if (!ProfileRate) return UINTPTR_MAX;
+
+    ProfileSeed ^= ProfileSeed << 13;
+    ProfileSeed ^= ProfileSeed >> 7;
+    ProfileSeed ^= ProfileSeed << 17;
+
+    return (ProfileRate >> 1) + static_cast<UIntPtr>(ProfileSeed) % ProfileRate;
+}
+
+Void Heap::Sample(Void *Address, UIntPtr Size) {
+    /* The first HEAP_PROFILE_SKIP entries of the stack are ourselves and the Allocate function that called us. Each
+     * sample stands for about ProfileRate bytes (or for itself, if it's bigger than that), so that's what we add to
+     * the site (and the allocation count is estimated from that as well). */
+
+    if ((ProfileCountdown = NextSample()) == UINTPTR_MAX) return;
+
+    UIntPtr stack[HEAP_PROFILE_DEPTH + HEAP_PROFILE_SKIP], hash = 0, bytes = Size > ProfileRate ? Size : ProfileRate,
+            count = bytes / (Size ? Size : 1), idx;
+    UInt8 depth = StackTrace::Trace(GetStackFrame(), stack, HEAP_PROFILE_DEPTH + HEAP_PROFILE_SKIP);
+
+    depth = depth > HEAP_PROFILE_SKIP ? depth - HEAP_PROFILE_SKIP : 0;
+
+    for (UInt8 i = 0; i < depth; i++) hash = (hash ^ stack[HEAP_PROFILE_SKIP + i]) * 16777619;
+
+    /* Find the site (linear probing, the sites are never removed while profiling, and an used site always has a
+     * non-zero TotalCount). We always leave one entry free, so that the loop ends. */
+
+    for (idx = hash & (HEAP_PROFILE_SITES - 1);; idx = (idx + 1) & (HEAP_PROFILE_SITES - 1)) {
+        ProfileSite &site = ProfileSites[idx];
+
+        if (site.TotalCount && site.Hash == hash && site.Depth == depth &&
+            CompareMemory(site.Stack, &stack[HEAP_PROFILE_SKIP], depth * sizeof(UIntPtr))) break;
+        else if (site.TotalCount) continue;
+        else if (ProfileSiteCount >= HEAP_PROFILE_SITES - 1) {
+            ProfileDropped++;
+            return;
+        }
+
+        CopyMemory(site.Stack, &stack[HEAP_PROFILE_SKIP], depth * sizeof(UIntPtr));
+        site.Hash = hash;
+        site.Depth = depth;
+        ProfileSiteCount++;
+
+        break;
+    }
+
+    ProfileSite &site = ProfileSites[idx];
+
+    site.TotalBytes += bytes;
+    site.TotalCount += count;
+
+    /* The site totals are still valid if we have no space to save the sample, we just can't track when it dies. */
+
+    if (ProfileFree == HEAP_PROFILE_NONE) {
+        ProfileDropped++;
+        return;
+    }
+
+    ProfileSample &sample = ProfileSamples[ProfileFree];
+    UIntPtr bucket = GetBucket(Address);
+
+    ProfileFree = sample.Next;
+    sample.Address = Address;
+    sample.Bytes = bytes;
+    sample.Count = count;
+    sample.Site = idx;
+    sample.Next = ProfileBuckets[bucket];
+    ProfileBuckets[bucket] = &sample - ProfileSamples;
+    ProfileLive++;
+
+    site.LiveBytes += bytes;
+    site.LiveCount += count;
+}
+
+Void Heap::Unsample(Void *Address) {
+    /* Most of the freed addresses were never sampled, and the bucket chains are short, so this should be quick. */
+
+    UIntPtr bucket = GetBucket(Address);
+
+    for (UInt16 *cur = &ProfileBuckets[bucket]; *cur != HEAP_PROFILE_NONE; cur = &ProfileSamples[*cur].Next) {
+        ProfileSample &sample = ProfileSamples[*cur];
+
+        if (sample.Address != Address) continue;
+
+        ProfileSites[sample.Site].LiveBytes -= sample.Bytes;
+        ProfileSites[sample.Site].LiveCount -= sample.Count;
+
+        UInt16 idx = *cur;
+
+        *cur = sample.Next;
+        sample.Next = ProfileFree;
+        ProfileFree = idx;
+        ProfileLive--;
+
+        return;
+    }
+}
+
+Void Heap::DumpProfile(UIntPtr Count) {
+    /* Print the sites with the most live bytes first (all the values are estimates, based on the sampling rate). */
+
+    UInt16 order[HEAP_PROFILE_SITES];
+    UIntPtr count = 0, off;
+
+    for (UIntPtr i = 0; i < HEAP_PROFILE_SITES; i++) {
+        if (ProfileSites[i].TotalCount) order[count++] = i;
+    }
+
+    Sort(order, &order[count], [](UInt16 A, UInt16 B) {
+        return ProfileSites[A].LiveBytes > ProfileSites[B].LiveBytes;
+    });
+
+    Debug.Write("heap profile: sampling every ~{} bytes, {} live samples on {} call sites ({} samples dropped)\n",
+                ProfileRate, ProfileLive, ProfileSiteCount, ProfileDropped);
+
+    for (UIntPtr i = 0; i < count && i < Count; i++) {
+        ProfileSite &site = ProfileSites[order[i]];
+
+        Debug.Write("#{}: ~{} live bytes in ~{} allocations (~{} bytes in ~{} allocations in total)\n", i,
+                    site.LiveBytes, site.LiveCount, site.TotalBytes, site.TotalCount);
+
+        for (UInt8 j = 0; j < site.Depth; j++) {
+            StringView name;
+
+            if (StackTrace::GetSymbol(site.Stack[j], name, off)) {
+                Debug.Write("    0x{:0*:16}: {} +0x{:0:16}\n", site.Stack[j], name, off);
+            } else Debug.Write("    0x{:0*:16}: <no symbol information available>\n", site.Stack[j]);
+        }
+    }
+}
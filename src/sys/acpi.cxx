@@ -1,12 +1,159 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on March 11 of 2021, at 18:08 BRT
- * Last edited on March 13 of 2021 at 12:45 BRT */
+ * Last edited on October 17 of 2026 at 23:59 BRT */
 
-#include <sys/boot.hxx>
+#include <sys/arch.hxx>
+#include <sys/mm.hxx>
+#include <sys/panic.hxx>
 
-namespace CHicago {
+using namespace CHicago;
 
-Void Acpi::Initialize(BootInfo&) { }
+static_assert(ACPI_MAX_DOMAINS <= PHYS_MAX_NODES);
 
+UInt32 Acpi::Domains[ACPI_MAX_DOMAINS];
+UIntPtr Acpi::DomainCount = 0;
+
+Void Acpi::Initialize(BootInfo &Info) {
+    /* This should be called after VirtMem::Initialize (as we need the temp mapping window and the heap), but before
+     * PhysMem::FinishInitialization (as the buddy allocator needs to know the NUMA nodes before building the free
+     * lists). The loader gives us the physical address of the RSDT (or XSDT, if Extended is set), and we need to go
+     * through all the entries, searching for the tables that we need. */
+
+    SdtHeader *sdt;
+
+    if (!Info.Acpi.Sdt || (sdt = LoadTable(Info.Acpi.Sdt)) == Null) {
+        Debug.SetForeground(0xFFFFFF00);
+        Debug.Write("the ACPI tables are unavailable, assuming that there is only one NUMA node\n");
+        Debug.RestoreForeground();
+        return;
+    }
+
+    UIntPtr size = Info.Acpi.Extended ? 8 : 4, count = (sdt->Length - sizeof(SdtHeader)) / size;
+    auto entries = reinterpret_cast<UInt8*>(sdt) + sizeof(SdtHeader);
+
+    for (UIntPtr i = 0; i < count; i++) {
+        UInt64 addr = 0;
+        SdtHeader *table;
+
+        CopyMemory(&addr, &entries[i * size], size);
+
+        if (!addr || addr > UINTPTR_MAX || (table = LoadTable(addr)) == Null) continue;
+        else if (CompareMemory(table->Signature, "SRAT", 4)) ParseSrat(table);
+
+        delete[] reinterpret_cast<UInt8*>(table);
+    }
+
+    delete[] reinterpret_cast<UInt8*>(sdt);
+
+    Debug.Write("initialized the ACPI tables, there are {} NUMA node(s), and we're on node {}\n",
+                DomainCount ? DomainCount : 1, PhysMem::GetLocalNode());
+}
+
+Void Acpi::ReadPhysical(UIntPtr Physical, Void *Buffer, UIntPtr Size) {
+    /* The ACPI tables live outside of the usable RAM, and the direct map (on amd64) only covers the usable RAM, so copy
+     * one page at a time through the temp mapping window (MapTemp still uses the direct map, if the page is in there).
+     * The buffer should already be allocated, as the heap may also need the window while growing. */
+
+    auto dst = static_cast<UInt8*>(Buffer);
+
+    while (Size) {
+        UIntPtr off = Physical & PAGE_MASK, cnt = PAGE_SIZE - off < Size ? PAGE_SIZE - off : Size;
+        auto src = static_cast<UInt8*>(VirtMem::MapTemp(Physical & ~PAGE_MASK));
+
+        if (src == Null) {
+            SetMemory(dst, 0, Size);
+            return;
+        }
+
+        CopyMemory(dst, src + off, cnt);
+        VirtMem::UnmapTemp();
+
+        Physical += cnt;
+        dst += cnt;
+        Size -= cnt;
+    }
+}
+
+Acpi::SdtHeader *Acpi::LoadTable(UIntPtr Physical) {
+    /* Read the header first (to get the table size), and then copy the whole table into a heap buffer, validating the
+     * checksum (all the bytes of the table should sum to zero). */
+
+    SdtHeader hdr;
+
+    ReadPhysical(Physical, &hdr, sizeof(SdtHeader));
+
+    if (hdr.Length < sizeof(SdtHeader) || hdr.Length > 0x100000) return Null;
+
+    auto buf = new UInt8[hdr.Length];
+    UInt8 sum = 0;
+
+    if (buf == Null) return Null;
+
+    ReadPhysical(Physical, buf, hdr.Length);
+
+    for (UIntPtr i = 0; i < hdr.Length; i++) sum += buf[i];
+
+    if (sum) {
+        Debug.SetForeground(0xFFFFFF00);
+        Debug.Write("the ACPI table at 0x{:0*:16} has an invalid checksum\n", Physical);
+        Debug.RestoreForeground();
+        delete[] buf;
+        return Null;
+    }
+
+    return reinterpret_cast<SdtHeader*>(buf);
+}
+
+UInt8 Acpi::GetNode(UInt32 Domain) {
+    /* The proximity domains can be any 32-bit number, but the physical memory manager wants the nodes to be
+     * consecutive (starting at 0), so we give each new domain the next node number. */
+
+    for (UIntPtr i = 0; i < DomainCount; i++) {
+        if (Domains[i] == Domain) return i;
+    }
+
+    if (DomainCount >= ACPI_MAX_DOMAINS) {
+        Debug.SetForeground(0xFFFFFF00);
+        Debug.Write("too many NUMA proximity domains, treating domain {} as part of node 0\n", Domain);
+        Debug.RestoreForeground();
+        return 0;
+    }
+
+    return Domains[DomainCount] = Domain, DomainCount++;
+}
+
+Void Acpi::ParseSrat(SdtHeader *Table) {
+    /* Go through all the entries, registering the memory ranges with the physical memory manager, and finding which
+     * node the boot processor is on. */
+
+    UInt32 core = Arch::GetCoreID();
+    auto start = reinterpret_cast<UInt8*>(Table), cur = start + sizeof(SratHeader), end = start + Table->Length;
+
+    while (cur + 2 <= end && cur[1] >= 2 && cur + cur[1] <= end) {
+        if (cur[0] == SRAT_PROCESSOR && cur[1] >= sizeof(SratProcessor)) {
+            auto ent = reinterpret_cast<SratProcessor*>(cur);
+            UInt32 domain = ent->DomainLow | (ent->DomainHigh[0] << 8) | (ent->DomainHigh[1] << 16) |
+                            (ent->DomainHigh[2] << 24);
+
+            if ((ent->Flags & SRAT_ENABLED) && ent->ApicID == core) PhysMem::SetLocalNode(GetNode(domain));
+        } else if (cur[0] == SRAT_X2APIC && cur[1] >= sizeof(SratX2Apic)) {
+            auto ent = reinterpret_cast<SratX2Apic*>(cur);
+            if ((ent->Flags & SRAT_ENABLED) && ent->ApicID == core) PhysMem::SetLocalNode(GetNode(ent->Domain));
+        } else if (cur[0] == SRAT_MEMORY && cur[1] >= sizeof(SratMemory)) {
+            auto ent = reinterpret_cast<SratMemory*>(cur);
+
+            /* Ranges above what we can address (on x86) can just be ignored, as the physical memory manager doesn't
+             * know about them either. Ranges crossing the limit get clamped to the last page below it (the end still
+             * needs to fit in an UIntPtr, or AddNodeRange would see it wrapping around to 0). */
+
+            if ((ent->Flags & SRAT_ENABLED) && ent->Size && ent->Base <= UINTPTR_MAX) {
+                PhysMem::AddNodeRange(ent->Base, ent->Base + ent->Size - 1 > UINTPTR_MAX ?
+                                                 (UINTPTR_MAX - ent->Base) & ~PAGE_MASK : ent->Size,
+                                      GetNode(ent->Domain));
+            }
+        }
+
+        cur += cur[1];
+    }
 }
@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 06 of 2021, at 12:22 BRT
- * Last edited on April 10 of 2021, at 17:15 BRT */
+ * Last edited on October 17 of 2026, at 23:59 BRT */
 
 #include <sys/arch.hxx>
 #include <sys/mm.hxx>
@@ -34,15 +34,31 @@ extern "C" Void KernelEntry(BootInfo &Info) {
 
     Arch::Initialize(Info);
 
-    /* Initialize some important early system bits (backtrace symbol resolver, memory manager, etc). */
+    /* Initialize some important early system bits (backtrace symbol resolver, memory manager, etc). The ACPI tables
+     * need to be parsed before the physical memory manager finishes its initialization (as it needs to know about
+     * the NUMA nodes before building the buddy allocator free lists). */
 
     StackTrace::Initialize(Info);
+
+    UInt64 start = Arch::GetTimestamp();
     PhysMem::Initialize(Info);
+    UInt64 phys = Arch::GetTimestamp() - start;
+
     VirtMem::Initialize(Info);
+    Acpi::Initialize(Info);
+    PhysMem::FinishInitialization();
 
-    /* Initialize/map all the ACPI tables that we need for now. */
+    /* We have no idle thread yet, so fill the zero page pool right now (instead of doing it when the CPU has nothing
+     * better to do). */
 
-    Acpi::Initialize(Info);
+    PhysMem::RefillZeroPool();
+
+    /* The physical memory regions that PhysMem::Initialize deferred are left alone, the allocator initializes them
+     * once it runs out of memory (and later some background thread should do it). */
+
+    Debug.Write("PhysMem::Initialize took {} cycles, 0x{:0:16} bytes are still deferred\n", phys,
+                PhysMem::GetDeferred());
+    PhysMem::PrintStatistics();
 
     /* And for now our initialization is finished. */
 
@@ -1,7 +1,7 @@
 /* File author is Ítalo Lima Marconato Matias
  *
  * Created on February 28 of 2021, at 14:02 BRT
- * Last edited on April 18 of 2021, at 11:22 BRT */
+ * Last edited on October 17 of 2026, at 20:15 BRT */
 
 #include <sys/fs.hxx>
 
@@ -23,7 +23,7 @@ File::File(const File &Source)
           Length(Source.Length), INode(Source.INode) { if (References != Null) (*References)++; }
 
 File::File(const String &Name, UInt8 Flags, const FsImpl &Fs, UInt64 Length, const Void *Priv, UInt64 INode)
-    : Name(Name), Flags(Flags), Fs(Fs), Priv(Priv), References(new UIntPtr), Length(Length), INode(INode) {
+    : Name(Name), Flags(Flags), Fs(Fs), Priv(Priv), References(new UIntPtr(0)), Length(Length), INode(INode) {
     if (References != Null) (*References)++;
 }
 